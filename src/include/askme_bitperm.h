@@ -0,0 +1,71 @@
+#ifndef H_ASKME_BITPERM
+#define H_ASKME_BITPERM
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "askme_lib.h"
+
+/* Permutations of the options of a question, and the kernels that carry
+ * answer and response bitmaps (option n in bit n, bit 0 unused) between
+ * the order of the options in the file and the order they were shown in.
+ *
+ * Two kernels are provided:
+ *    table:   walks only the set bits of the bitmap and looks up where
+ *             each one goes. Cost is proportional to the number of set
+ *             bits, which is small for answers and responses.
+ *    pext:    an LSD radix sort of the bits by their destination, one
+ *             BMI2 sheep-and-goats (two pext) per bit of the width, so
+ *             at most six passes and no branches whatever the bitmap.
+ * askme_bitperm_to_display() and askme_bitperm_to_file() use the pext
+ * kernel when the CPU has BMI2 (it was as fast or faster at every width
+ * in askme_bitperm_bench) and the table kernel otherwise.
+ */
+
+#define ASKME_BITPERM_WIDTH      (64)
+#define ASKME_BITPERM_PASSES     (6)
+
+typedef struct askme_bitperm_t askme_bitperm_t;
+struct askme_bitperm_t {
+   size_t width;                             // Number of options + 1
+   uint8_t to_display[ASKME_BITPERM_WIDTH];  // File position -> shown position
+   uint8_t to_file[ASKME_BITPERM_WIDTH];     // Shown position -> file position
+
+   // Sheep-and-goats masks for the pext kernel, one set per direction.
+   size_t npasses;
+   uint64_t display_masks[ASKME_BITPERM_PASSES];
+   uint64_t file_masks[ASKME_BITPERM_PASSES];
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   void askme_bitperm_identity (askme_bitperm_t *bp, size_t noptions);
+
+   // The shuffle is derived only from the seed and the question number,
+   // so a resumed session shows the options in the same order.
+   void askme_bitperm_shuffle (askme_bitperm_t *bp, size_t noptions,
+                               unsigned int seed, size_t question);
+
+   // The option (counting from 1, in file order) shown at the given
+   // position (counting from 1).
+   size_t askme_bitperm_option (const askme_bitperm_t *bp, size_t position);
+
+   uint64_t askme_bitperm_to_display (const askme_bitperm_t *bp, uint64_t bitmap);
+   uint64_t askme_bitperm_to_file (const askme_bitperm_t *bp, uint64_t bitmap);
+
+   // The individual kernels, for the benchmark.
+   uint64_t askme_bitperm_apply_loop (const uint8_t *map, size_t width, uint64_t bitmap);
+   uint64_t askme_bitperm_apply_table (const uint8_t *map, uint64_t bitmap);
+   uint64_t askme_bitperm_apply_pext (const uint64_t *masks, size_t npasses,
+                                      size_t width, uint64_t bitmap);
+   bool askme_bitperm_have_pext (void);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
@@ -0,0 +1,45 @@
+#ifndef H_ASKME_INDEX
+#define H_ASKME_INDEX
+
+#include <stddef.h>
+
+/* A line-offset index for a topic file, kept in ~/.askme/index/<topic>,
+ * so that any single record can be read straight from disk without
+ * reading the records before it. The index is used as it is only while
+ * the size and modification time (to the nanosecond) of the topic are
+ * exactly as they were when it was written.
+ *
+ * When the size or modification time of the topic no longer matches the
+ * index, the part of the topic that the index covers is hashed again
+ * and compared with the hash kept in the index. If it is unchanged the
+ * topic has only been appended to, and only the new tail is scanned and
+ * added to the index; otherwise the whole index is rebuilt.
+ *
+ * Only lines that hold a record are indexed; lines that are empty or
+ * consist only of tabs are skipped, exactly as the question loader
+ * skips them, so record N in the index is question N in the table. The
+ * loader rejects a last line without its newline, so that line is left
+ * out of the index until the newline arrives.
+ */
+
+typedef struct askme_index_t askme_index_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   askme_index_t *askme_index_open (const char *topic);
+   void askme_index_close (askme_index_t *idx);
+
+   size_t askme_index_count (const askme_index_t *idx);
+
+   // Returns the record (without the newline) in a newly allocated
+   // string that the caller must free, or NULL on error.
+   char *askme_index_read (askme_index_t *idx, size_t record);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
@@ -0,0 +1,45 @@
+#ifndef H_ASKME_TELEMETRY
+#define H_ASKME_TELEMETRY
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Per-question latency and retry telemetry for a session. Everything is
+ * kept in memory while the session runs and only written out, as JSON
+ * Lines, when the telemetry is closed, so recording never touches the
+ * disk while the user is answering.
+ *
+ * All the functions accept a NULL telemetry object and do nothing, so
+ * callers need not check whether telemetry was requested.
+ */
+
+typedef struct askme_telemetry_t askme_telemetry_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Opens fname for writing and starts the clock.
+   askme_telemetry_t *askme_telemetry_new (const char *fname);
+
+   // Ends the current phase (if any) and starts the named one.
+   void askme_telemetry_phase (askme_telemetry_t *tm, const char *name);
+
+   void askme_telemetry_question_begin (askme_telemetry_t *tm);
+   void askme_telemetry_question_retry (askme_telemetry_t *tm);
+   void askme_telemetry_question_end (askme_telemetry_t *tm, const char *topic,
+                                      size_t position, size_t question);
+
+   // Records whether the answer at the given position was correct.
+   void askme_telemetry_grade (askme_telemetry_t *tm, size_t position, bool correct);
+
+   // Writes all the records followed by a latency summary per topic,
+   // then closes the file. Returns false if any of it failed.
+   bool askme_telemetry_close (askme_telemetry_t *tm);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
@@ -0,0 +1,22 @@
+
+#ifndef H_ASKME_UTIL
+#define H_ASKME_UTIL
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // TODO: Unimplemented
+   char **askme_util_str_split (const char *src, const char delim);
+
+
+#ifdef __cplusplus
+};
+#endif
+
+
+
+
+
+#endif
+
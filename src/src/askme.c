@@ -8,6 +8,11 @@
 #include <ctype.h>
 
 #include "askme_lib.h"
+#include "askme_journal.h"
+#include "askme_telemetry.h"
+#include "askme_sample.h"
+#include "askme_bitperm.h"
+#include "askme_history.h"
 
 #include "ds_str.h"
 
@@ -36,7 +41,8 @@
 #define COLOR_BG_MAGENTA      "\x1b[46m"
 #define COLOR_BG_WHITE        "\x1b[47m"
 
-size_t parse_numbers (const char *string)
+// Fails on any number that could never be an option.
+bool parse_numbers (const char *string, size_t *dst)
 {
    size_t ret = 0;
    const char *tmp = string;
@@ -47,12 +53,17 @@ size_t parse_numbers (const char *string)
       }
       if ((sscanf (tmp, "%zu", &number))!=1)
          continue;
+      if (number > ASKME_MAX_OPTIONS) {
+         ASKME_LOG (COLOR_FG_RED "Response [%zu] is not an option" COLOR_DEFAULT "\n", number);
+         return false;
+      }
       ASKME_SETBIT (ret, number);
       while (*tmp && isdigit (*tmp)) {
          tmp++;
       }
    }
-   return ret;
+   *dst = ret;
+   return true;
 }
 
 char *printbin (size_t num, char *dst)
@@ -74,6 +85,38 @@ static const char *help_msg[] = {
 "                    as sorted alphabetically).",
 "  --show-grades     The grades for the selected topic will be displayed",
 "                    and no test will be run.",
+"  --shuffle-options Show the options of each question in a random order.",
+"  --seed            The seed used to randomise the questions (default 9).",
+"  --resume          Continue the interrupted session for the topic",
+"                    instead of starting a new one.",
+"  --discard-session Start a new session for the topic, throwing away the",
+"                    interrupted one.",
+"  --journal-sync-count  Number of answers between flushes of the session",
+"                    journal to disk (default 16).",
+"  --journal-sync-ms The longest time, in milliseconds, that an answer is",
+"                    left in the session journal before it is flushed to",
+"                    disk (default 1000).",
+"  --sample          Ask questions drawn from several topics. The value is",
+"                    a comma-separated list of topics, each with an",
+"                    optional weight (--sample=topic-a:3,topic-b:1,topic-c).",
+"                    Topics without a weight, or every topic if no list",
+"                    is given, are weighted by their recent grades.",
+"  --telemetry       Write the time taken to answer each question, the",
+"                    number of invalid answers given for it and the time",
+"                    taken by each phase of the test to the specified",
+"                    file as JSON Lines, followed by a latency summary.",
+"  --retry-wrong     Only ask questions that were answered wrongly the",
+"                    last time they were asked.",
+"  --unseen          Only ask questions that have never been asked.",
+"  --ever-wrong      Only ask questions that have ever been answered wrongly.",
+"  --flagged         Only ask questions that have been flagged (enter 'f'",
+"                    while a question is shown to flag or unflag it).",
+"  --select          Only ask the questions in a selection built from the",
+"                    sets seen, unseen, wrong, retry, flagged and all with",
+"                    '&', '|', '-', '!' and parentheses, for example",
+"                    --select='(retry|unseen)-flagged'. If any of the",
+"                    options above are also given, only questions in both",
+"                    this selection and at least one of those are asked.",
 "",
 "  Topics must be stored as a tab-seperated list of questions",
 "in $HOME/.askme/topics. Each line comprises a single record",
@@ -95,8 +138,105 @@ static const char *help_msg[] = {
 "  Grades are stored for each topic and the cumulative total will be",
 "displayed at the end of the test. The test scores can also be seen",
 "with the --show-grades option.",
+"",
+"  Each answer is journalled in $HOME/.askme/sessions as it is given. If",
+"a test is interrupted it can be continued with the --resume option. A",
+"new test of the topic is refused until the interrupted one is resumed",
+"or discarded with --discard-session.",
+"",
+"  Which questions have been asked, answered wrongly or flagged is kept",
+"for each topic in $HOME/.askme/history and is used by the selection",
+"options above.",
 };
 
+static const char *question_topic (const askme_sample_t *sample, size_t question,
+                                   const char *topic)
+{
+   return sample ? sample->topics[sample->topic[question]] : topic;
+}
+
+// The record number of the question within the topic it came from.
+static size_t question_record (const askme_sample_t *sample, size_t question)
+{
+   return sample ? sample->record[question] : question;
+}
+
+// Works out the order in which the options of a question are shown.
+static void question_options (askme_bitperm_t *bp, const askme_qtable_t *qt, size_t question,
+                              bool shuffle, unsigned int seed)
+{
+   if (shuffle) {
+      askme_bitperm_shuffle (bp, qt->noptions[question], seed, question);
+   } else {
+      askme_bitperm_identity (bp, qt->noptions[question]);
+   }
+}
+
+// The history of the topic a question came from, and the index of the
+// question within that topic.
+static askme_history_t *question_history (askme_history_t **histories,
+                                          const askme_sample_t *sample,
+                                          size_t question, size_t *record)
+{
+   if (!histories)
+      return NULL;
+
+   *record = question_record (sample, question);
+   return histories[sample ? sample->topic[question] : 0];
+}
+
+static void save_histories (askme_history_t **histories, size_t nhistories)
+{
+   for (size_t i=0; histories && i<nhistories; i++) {
+      if (histories[i] && !(askme_history_save (histories[i]))) {
+         ASKME_LOG ("Warning: Failed to save the question history [%s]\n", histories[i]->path);
+      }
+   }
+}
+
+// Combines the selection options into a single --select expression, or
+// returns NULL if none were given.
+static char *selection_expr (void)
+{
+   static const struct {
+      const char *option;
+      const char *set;
+   } options[] = {
+      { "retry-wrong",  "retry"     },
+      { "unseen",       "unseen"    },
+      { "ever-wrong",   "wrong"     },
+      { "flagged",      "flagged"   },
+   };
+   char *any = NULL;
+   char *ret = NULL;
+
+   for (size_t i=0; i<sizeof options / sizeof options[0]; i++) {
+      if (!getenv (options[i].option))
+         continue;
+      char *tmp = any ? ds_str_cat (any, "|", options[i].set, NULL) : ds_str_dup (options[i].set);
+      free (any);
+      if (!(any = tmp)) {
+         ASKME_LOG ("OOM error\n");
+         return NULL;
+      }
+   }
+
+   if (!getenv ("select")) {
+      return any;
+   }
+
+   if (any) {
+      ret = ds_str_cat ("(", getenv ("select"), ")&(", any, ")", NULL);
+   } else {
+      ret = ds_str_dup (getenv ("select"));
+   }
+   if (!ret) {
+      ASKME_LOG ("OOM error\n");
+   }
+   free (any);
+   return ret;
+}
+
 static void print_msg (const char **msg)
 {
    for (size_t i=0; msg[i]; i++) {
@@ -112,9 +252,25 @@ int main (int argc, char **argv)
    char *topic = NULL;
    bool free_topic = false;
    const char *prompt = getenv ("PS2");
-   char ***questions = NULL;
+   askme_qtable_t *qt = NULL;
+   size_t *order = NULL;
    uint64_t *responses = NULL;
    static char input[1024];
+   unsigned int seed = 9;
+   askme_session_t session = { 0 };
+   askme_journal_t *journal = NULL;
+   askme_telemetry_t *telemetry = NULL;
+   const char *sample_spec = NULL;
+   askme_sample_t *sample = NULL;
+   static char sample_session[] = ".sample";
+   bool shuffle_options = false;
+   askme_bitperm_t bp;
+   size_t first_question = 0;
+   size_t nanswered = 0;
+   bool interrupted = false;
+   char *selection = NULL;
+   askme_history_t **histories = NULL;
+   size_t nhistories = 0;
 
    char *out_option = NULL;
    const char *out_template = NULL;
@@ -139,6 +295,21 @@ int main (int argc, char **argv)
       }
    }
 
+   if (getenv ("seed")) {
+      if ((sscanf (getenv ("seed"), "%u", &seed))!=1) {
+         ASKME_LOG ("Unable to read [%s] as a seed\n", getenv ("seed"));
+         goto errorexit;
+      }
+   }
+
+   if (getenv ("telemetry")) {
+      if (!(telemetry = askme_telemetry_new (getenv ("telemetry")))) {
+         ASKME_LOG (COLOR_FG_RED "Unable to write telemetry to [%s]" COLOR_DEFAULT "\n",
+                    getenv ("telemetry"));
+         goto errorexit;
+      }
+   }
+
    if (getenv ("show-grades")) {
       ASKME_LOG ("Unimplemented\n");
       goto errorexit;
@@ -146,8 +317,19 @@ int main (int argc, char **argv)
 
    free_topic = false;
    topic = getenv ("topic");
+   sample_spec = getenv ("sample");
+   shuffle_options = getenv ("shuffle-options") != NULL;
+   selection = selection_expr ();
 
-   if (!topic) {
+   if (selection && sample_spec) {
+      ASKME_LOG (COLOR_FG_RED "Questions cannot be selected from a --sample" COLOR_DEFAULT "\n");
+      goto errorexit;
+   }
+
+   if (sample_spec) {
+      // Sampled sessions are journalled under their own name
+      topic = sample_session;
+   } else if (!topic) {
       char **topics = askme_list_topics ();
       size_t ntopics = 0;
       if (!topics || !topics[0]) {
@@ -186,20 +368,84 @@ int main (int argc, char **argv)
       free (topics);
    }
 
-   printf ("Seeking %zu questions from topic [%s]\n", nquestions, topic);
-   if (!(questions = askme_load_questions (topic))) {
-      ASKME_LOG (COLOR_FG_RED "Failed to load questions from [%s]" COLOR_DEFAULT "\n", topic);
+   if (!getenv ("resume") && askme_journal_exists (topic)) {
+      if (!getenv ("discard-session")) {
+         ASKME_LOG (COLOR_FG_RED "[%s] has an interrupted session. Use --resume to continue it "
+                    "or --discard-session to start a new one" COLOR_DEFAULT "\n", topic);
+         goto errorexit;
+      }
+      if (!(askme_journal_discard (topic))) {
+         goto errorexit;
+      }
+   }
+
+   if (getenv ("resume")) {
+      // Pick up the order and the responses from the interrupted session
+      if (!(askme_journal_load (topic, &session))) {
+         ASKME_LOG (COLOR_FG_RED "No session to resume for [%s]" COLOR_DEFAULT "\n", topic);
+         goto errorexit;
+      }
+      seed = session.seed;
+      nquestions = session.nquestions;
+   }
+
+   askme_telemetry_phase (telemetry, "load");
+   if (sample_spec && getenv ("resume")) {
+      // Ask exactly the questions that were drawn, whatever the spec and
+      // the grades say now.
+      if (!session.ntopics) {
+         ASKME_LOG (COLOR_FG_RED "The interrupted session did not record its sample"
+                    COLOR_DEFAULT "\n");
+         goto errorexit;
+      }
+      if (sample_spec[0]) {
+         ASKME_LOG ("Resuming the sampled session, ignoring [%s]\n", sample_spec);
+      }
+      if (!(sample = askme_sample_load (session.topics, session.ntopics,
+                                        session.sample_topic, session.sample_record,
+                                        session.total_questions))) {
+         ASKME_LOG (COLOR_FG_RED "Failed to reload the sampled questions" COLOR_DEFAULT "\n");
+         goto errorexit;
+      }
+      qt = sample->qt;
+   } else if (sample_spec) {
+      printf ("Sampling %zu questions\n", nquestions);
+      if (!(sample = askme_sample_new (sample_spec, nquestions, seed))) {
+         ASKME_LOG (COLOR_FG_RED "Failed to sample questions from [%s]" COLOR_DEFAULT "\n",
+                    sample_spec);
+         goto errorexit;
+      }
+      qt = sample->qt;
+   } else {
+      printf ("Seeking %zu questions from topic [%s]\n", nquestions, topic);
+      if (!(qt = askme_qtable_load (topic))) {
+         ASKME_LOG (COLOR_FG_RED "Failed to load questions from [%s]" COLOR_DEFAULT "\n", topic);
+         goto errorexit;
+      }
+   }
+
+   // Each topic asked from keeps its own history
+   nhistories = sample ? sample->ntopics : 1;
+   if (!(histories = calloc (nhistories, sizeof *histories))) {
+      ASKME_LOG ("OOM error - cannot allocate %zu histories\n", nhistories);
       goto errorexit;
    }
+   for (size_t i=0; i<nhistories; i++) {
+      const char *name = sample ? sample->topics[i] : topic;
+      if (!(histories[i] = askme_history_load (name))) {
+         ASKME_LOG ("Warning: the question history for [%s] will not be updated\n", name);
+      }
+   }
 
    // Limit number of questions to what we actually have.
-   size_t total_questions = askme_count_questions (questions);
+   size_t total_questions = askme_qtable_count (qt);
    if (nquestions > total_questions) {
       nquestions = total_questions;
    }
 
-   // Randomise the array
-   askme_randomise_questions (questions);
+   if (!(order = askme_qtable_order (qt))) {
+      goto errorexit;
+   }
 
    // Generate the array to store the user responses
    if (!(responses = calloc (total_questions, sizeof *responses))) {
@@ -210,19 +456,84 @@ int main (int argc, char **argv)
    }
    memset (responses, 0xff, sizeof *responses);
 
+   if (getenv ("resume")) {
+      if (session.total_questions != total_questions) {
+         ASKME_LOG (COLOR_FG_RED "Topic [%s] has changed since the session was started "
+                    "(%zu questions, was %zu)" COLOR_DEFAULT "\n",
+                    topic, total_questions, session.total_questions);
+         goto errorexit;
+      }
+      nquestions = session.nquestions;
+      memcpy (order, session.order, nquestions * sizeof *order);
+      memcpy (responses, session.responses, session.nanswered * sizeof *responses);
+      first_question = session.nanswered;
+      nanswered = session.nanswered;
+      printf ("Resuming at question %zu of %zu\n", first_question + 1, nquestions);
+
+      if (!(journal = askme_journal_open (topic, &session))) {
+         ASKME_LOG ("Warning: this session will not be journalled\n");
+      }
+   } else {
+      size_t nselected = total_questions;
+
+      if (selection) {
+         askme_qset_t *selected = NULL;
+         if (!histories[0]
+               || !(selected = askme_history_select (histories[0], selection, total_questions))) {
+            ASKME_LOG (COLOR_FG_RED "Unable to select questions with [%s]" COLOR_DEFAULT "\n",
+                       selection);
+            goto errorexit;
+         }
+         nselected = askme_qset_count (selected);
+         askme_qset_fill (selected, order);
+         askme_qset_del (selected);
+
+         printf ("Selected %zu of %zu questions\n", nselected, total_questions);
+         if (!nselected) {
+            ASKME_LOG (COLOR_FG_RED "No questions match [%s]" COLOR_DEFAULT "\n", selection);
+            goto errorexit;
+         }
+         if (nquestions > nselected) {
+            nquestions = nselected;
+         }
+      }
+
+      // Randomise the order in which questions are asked
+      askme_randomise_order (order, nselected, seed);
+
+      if (!(journal = askme_journal_create (topic, seed, total_questions, order, nquestions))) {
+         ASKME_LOG ("Warning: this session will not be journalled\n");
+      }
+
+      if (journal && sample
+            && !(askme_journal_sample (journal, sample->topics, sample->ntopics,
+                                       sample->topic, sample->record, total_questions))) {
+         // Without the sample the journal cannot be resumed
+         ASKME_LOG ("Warning: this session will not be journalled\n");
+         askme_journal_close (journal, true);
+         journal = NULL;
+      }
+   }
+
    // Print the questions and store the responses
-   for (size_t i=0; i<nquestions; i++) {
+   askme_telemetry_phase (telemetry, "exam");
+   for (size_t i=first_question; i<nquestions; i++) {
       bool answered = false;
+      size_t q = order[i];
+      question_options (&bp, qt, q, shuffle_options, seed);
+      askme_telemetry_question_begin (telemetry);
       while (!answered && !feof (stdin) && !ferror (stdin)) {
-         size_t noptions = 0;
-         printf ("Q-%05zu) %s\n", i+1, questions[i][ASKME_QIDX_QUESTION]);
-         for (size_t j=2; questions[i][j]; j++) {
-            printf ("   %zu: %s\n", j-1, questions[i][j]);
-            noptions++;
+         size_t noptions = bp.width - 1;
+         printf ("Q-%05zu) %s\n", i+1, askme_qtable_question (qt, q));
+         for (size_t j=1; j<=noptions; j++) {
+            printf ("   %zu: %s\n", j, askme_qtable_option (qt, q, askme_bitperm_option (&bp, j) - 1));
          }
          printf ("%s", prompt);
          fflush (stdout);
-         fgets (input, sizeof input, stdin);
+         if (!(fgets (input, sizeof input, stdin))) {
+            interrupted = true;
+            break;
+         }
 
          char *tmp = strchr (input, '\n');
          if (tmp)
@@ -235,6 +546,16 @@ int main (int argc, char **argv)
             break;
          }
 
+         if (tmp[0] == 'f' || tmp[0] == 'F') {
+            size_t record;
+            askme_history_t *history = question_history (histories, sample, q, &record);
+            bool flagged = history && !askme_history_flagged (history, record);
+            if (history && (askme_history_flag (history, record, flagged))) {
+               printf ("Question %s\n", flagged ? "flagged" : "unflagged");
+            }
+            continue;
+         }
+
          bool not_number = false;
          for (size_t j=0; tmp[j]; j++) {
             if (!(isdigit (tmp[j])) && !(isspace (tmp[j]))) {
@@ -244,57 +565,96 @@ int main (int argc, char **argv)
                not_number = true;
             }
          }
-         if (not_number)
+         if (not_number) {
+            askme_telemetry_question_retry (telemetry);
             continue;
+         }
 
-         size_t response = parse_numbers (input);
+         size_t response = 0;
+         if (!(parse_numbers (input, &response))) {
+            askme_telemetry_question_retry (telemetry);
+            continue;
+         }
          // char buf[65];
          // printbin (response, buf);
          // ASKME_LOG ("Response = [%s]\n", buf);
          bool too_large = false;
-         for (size_t j=noptions+1; j<31; j++) {
+         for (size_t j=noptions+1; j<64; j++) {
             if (ASKME_TSTBIT (response, j)) {
                ASKME_LOG (COLOR_FG_RED "Response [%zu] is not an option" COLOR_DEFAULT "\n", j);
                too_large = true;
             }
          }
-         if (too_large)
+         if (too_large) {
+            askme_telemetry_question_retry (telemetry);
             continue;
+         }
 
          if (ASKME_TSTBIT (response, 0)) {
             ASKME_LOG (COLOR_FG_RED "Response [0] is not an option" COLOR_DEFAULT "\n");
+            askme_telemetry_question_retry (telemetry);
             continue;
          }
 
-         responses[i] = response;
+         // Responses are kept in file order, whatever order they were shown in
+         responses[i] = askme_bitperm_to_file (&bp, response);
          answered = true;
+         nanswered = i + 1;
+         askme_telemetry_question_end (telemetry, question_topic (sample, q, topic), i,
+                                       question_record (sample, q));
+         if (journal && !(askme_journal_response (journal, i, responses[i]))) {
+            ASKME_LOG ("Warning: failed to journal the response to question %zu\n", i+1);
+         }
       }
+      if (interrupted)
+         break;
    }
 
+   if (interrupted) {
+      ASKME_LOG (COLOR_FG_RED "Input ended before the test was completed. Use --resume "
+                 "to continue this test." COLOR_DEFAULT "\n");
+      // Keep any flags that were set
+      save_histories (histories, nhistories);
+      goto errorexit;
+   }
+
+   askme_telemetry_phase (telemetry, "grading");
    size_t correct = 0;
    // First, print out all the correct answers
    for (size_t i=0; i<nquestions; i++) {
-      size_t answer = askme_parse_answer (questions[i][ASKME_QIDX_ANSBMP]);
-      if (answer == responses[i]) {
-         printf ("Q-%05zu) %s: ", i+1, questions[i][ASKME_QIDX_QUESTION]);
+      bool is_correct = qt->answer[order[i]] == responses[i];
+      askme_telemetry_grade (telemetry, i, is_correct);
+
+      // Questions left unasked after a quit are not part of the history
+      size_t record;
+      askme_history_t *history = question_history (histories, sample, order[i], &record);
+      if (i < nanswered && history && !(askme_history_grade (history, record, is_correct))) {
+         ASKME_LOG ("Warning: failed to record question %zu in the history\n", i+1);
+      }
+      if (is_correct) {
+         printf ("Q-%05zu) %s: ", i+1, askme_qtable_question (qt, order[i]));
          printf ("[" COLOR_FG_GREEN SYMBOL_TICK COLOR_DEFAULT "]\n");
          correct++;
       }
    }
    for (size_t i=0; i<nquestions; i++) {
       // Finally, print out all the wrong answers
-      size_t answer = askme_parse_answer (questions[i][ASKME_QIDX_ANSBMP]);
-      if (answer != responses[i]) {
-
-         printf ("Q-%05zu) %s: ", i+1, questions[i][ASKME_QIDX_QUESTION]);
+      size_t q = order[i];
+      if (qt->answer[q] != responses[i]) {
+         // Show the options in the order they were asked in
+         question_options (&bp, qt, q, shuffle_options, seed);
+         uint64_t answer = askme_bitperm_to_display (&bp, qt->answer[q]);
+         uint64_t response = askme_bitperm_to_display (&bp, responses[i]);
+
+         printf ("Q-%05zu) %s: ", i+1, askme_qtable_question (qt, q));
          printf ("[" COLOR_FG_RED SYMBOL_CROSS COLOR_DEFAULT "]\n");
-         for (size_t j=ASKME_QIDX_OPTION_OFFS; questions[i][j]; j++) {
-            size_t q_index = (j+1) - ASKME_QIDX_OPTION_OFFS;
+         for (size_t q_index=1; q_index<bp.width; q_index++) {
+            size_t option = askme_bitperm_option (&bp, q_index) - 1;
 
             free (out_option); out_option = NULL;
 
             // Format the text of the option
-            if (!(out_option = ds_str_cat ("   ", questions[i][j], NULL))) {
+            if (!(out_option = ds_str_cat ("   ", askme_qtable_option (qt, q, option), NULL))) {
                ASKME_LOG ("OOM error\n");
                goto errorexit;
             }
@@ -313,7 +673,7 @@ int main (int argc, char **argv)
 
             // Format the response given
             out_response = "   ";
-            if ((ASKME_TSTBIT (responses[i], q_index))) {
+            if ((ASKME_TSTBIT (response, q_index))) {
                out_response = ("[" COLOR_FG_GREEN SYMBOL_CIRCLE COLOR_DEFAULT "]");
             }
             fputs (out_option, stdout);   fputs (" ", stdout);
@@ -327,27 +687,67 @@ int main (int argc, char **argv)
    float perc = ((float)correct/nquestions) * 100;
    printf ("Final grade: %zu/%zu (%.0f%%)\n", correct, nquestions, perc);
 
-   if (!(askme_save_grade (topic, correct, nquestions))) {
+   bool saved = true;
+   if (sample) {
+      // Each topic gets a grade for the questions that were drawn from it
+      for (size_t t=0; t<sample->ntopics; t++) {
+         size_t topic_correct = 0, topic_total = 0;
+         for (size_t i=0; i<nquestions; i++) {
+            if (sample->topic[order[i]] != t)
+               continue;
+            topic_total++;
+            if (qt->answer[order[i]] == responses[i])
+               topic_correct++;
+         }
+         if (!topic_total)
+            continue;
+         printf ("   %s: %zu/%zu\n", sample->topics[t], topic_correct, topic_total);
+         if (!(askme_save_grade (sample->topics[t], topic_correct, topic_total))) {
+            ASKME_LOG ("Warning: Failed to save the grade for [%s]: %m\n", sample->topics[t]);
+            saved = false;
+         }
+      }
+   } else if (!(askme_save_grade (topic, correct, nquestions))) {
       ASKME_LOG ("Warning: Failed to save this grade: %m\n");
+      saved = false;
+   }
+
+   save_histories (histories, nhistories);
+
+   if (saved) {
+      askme_journal_close (journal, true);
+      journal = NULL;
    }
 
    ret = EXIT_SUCCESS;
 
 errorexit:
 
+   askme_journal_close (journal, false);
+   askme_session_free (&session);
+
+   if (!(askme_telemetry_close (telemetry))) {
+      ASKME_LOG ("Warning: Failed to write the telemetry\n");
+   }
+
    free (responses);
    free (out_option);
+   free (selection);
+
+   for (size_t i=0; histories && i<nhistories; i++) {
+      askme_history_del (histories[i]);
+   }
+   free (histories);
 
    if (free_topic)
       free (topic);
 
-   for (size_t i=0; questions && questions[i]; i++) {
-      for (size_t j=0; questions[i][j]; j++) {
-         free (questions[i][j]);
-      }
-      free (questions[i]);
+   free (order);
+   if (sample) {
+      askme_sample_del (sample);
+   } else {
+      askme_qtable_del (qt);
    }
-   free (questions);
    return ret;
 }
 
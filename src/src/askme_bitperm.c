@@ -0,0 +1,223 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "askme_lib.h"
+#include "askme_bitperm.h"
+
+#if defined (__GNUC__) && defined (__x86_64__)
+#define HAVE_PEXT_KERNEL
+#include <immintrin.h>
+#endif
+
+static uint64_t splitmix64 (uint64_t *state)
+{
+   uint64_t z = (*state += UINT64_C(0x9E3779B97F4A7C15));
+   z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+   z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+   return z ^ (z >> 31);
+}
+
+static uint64_t width_mask (size_t width)
+{
+   return width >= 64 ? ~UINT64_C(0) : (UINT64_C(1) << width) - 1;
+}
+
+// Works out the sheep-and-goats masks that sort the bits of a bitmap by
+// their destination: pass b moves the bits whose destination has bit b
+// set above those that don't, keeping the order within each group. After
+// the last pass every bit is at its destination. Passes that would not
+// move anything are left out.
+static size_t compile_masks (const uint8_t *map, size_t width, uint64_t *masks)
+{
+   uint8_t keys[ASKME_BITPERM_WIDTH];
+   uint8_t tmp[ASKME_BITPERM_WIDTH];
+   size_t nbits = 0;
+   size_t npasses = 0;
+
+   while (((size_t)1 << nbits) < width) {
+      nbits++;
+   }
+
+   memcpy (keys, map, width);
+   for (size_t b=0; b<nbits; b++) {
+      uint64_t mask = 0;
+      size_t n = 0;
+      for (size_t p=0; p<width; p++) {
+         if ((keys[p] >> b) & 1) {
+            mask |= UINT64_C(1) << p;
+         } else {
+            tmp[n++] = keys[p];
+         }
+      }
+      for (size_t p=0; p<width; p++) {
+         if ((keys[p] >> b) & 1)
+            tmp[n++] = keys[p];
+      }
+
+      // Nothing moves if the ones are already all above the zeros.
+      uint64_t ones_above = width_mask (width) & ~width_mask (width - __builtin_popcountll (mask));
+      if (mask != ones_above) {
+         masks[npasses++] = mask;
+      }
+      memcpy (keys, tmp, width);
+   }
+
+   return npasses;
+}
+
+static void compile (askme_bitperm_t *bp)
+{
+   size_t np_display = compile_masks (bp->to_display, bp->width, bp->display_masks);
+   size_t np_file = compile_masks (bp->to_file, bp->width, bp->file_masks);
+
+   // Both directions run the same number of passes; pad the shorter with
+   // empty masks, which leave the bitmap alone.
+   bp->npasses = np_display > np_file ? np_display : np_file;
+   for (size_t i=np_display; i<bp->npasses; i++)
+      bp->display_masks[i] = 0;
+   for (size_t i=np_file; i<bp->npasses; i++)
+      bp->file_masks[i] = 0;
+}
+
+void askme_bitperm_identity (askme_bitperm_t *bp, size_t noptions)
+{
+   if (noptions > ASKME_MAX_OPTIONS)
+      noptions = ASKME_MAX_OPTIONS;
+
+   memset (bp, 0, sizeof *bp);
+   bp->width = noptions + 1;
+   for (size_t i=0; i<bp->width; i++) {
+      bp->to_display[i] = i;
+      bp->to_file[i] = i;
+   }
+}
+
+void askme_bitperm_shuffle (askme_bitperm_t *bp, size_t noptions,
+                            unsigned int seed, size_t question)
+{
+   uint64_t state = ((uint64_t)seed << 32) ^ question;
+
+   askme_bitperm_identity (bp, noptions);
+
+   // Fisher-Yates over positions 1..n; position 0 is never an option.
+   for (size_t i=bp->width - 1; i>1; i--) {
+      size_t j = 1 + splitmix64 (&state) % i;
+      uint8_t tmp = bp->to_file[i];
+      bp->to_file[i] = bp->to_file[j];
+      bp->to_file[j] = tmp;
+   }
+   for (size_t i=0; i<bp->width; i++) {
+      bp->to_display[bp->to_file[i]] = i;
+   }
+
+   compile (bp);
+}
+
+size_t askme_bitperm_option (const askme_bitperm_t *bp, size_t position)
+{
+   return bp->to_file[position];
+}
+
+/* ******************************************************************** */
+
+uint64_t askme_bitperm_apply_loop (const uint8_t *map, size_t width, uint64_t bitmap)
+{
+   uint64_t ret = 0;
+   for (size_t i=0; i<width; i++) {
+      if ((bitmap >> i) & 1)
+         ret |= UINT64_C(1) << map[i];
+   }
+   return ret;
+}
+
+uint64_t askme_bitperm_apply_table (const uint8_t *map, uint64_t bitmap)
+{
+   uint64_t ret = 0;
+   while (bitmap) {
+      ret |= UINT64_C(1) << map[__builtin_ctzll (bitmap)];
+      bitmap &= bitmap - 1;
+   }
+   return ret;
+}
+
+#ifdef HAVE_PEXT_KERNEL
+__attribute__ ((target ("bmi2,popcnt")))
+static uint64_t apply_pext (const uint64_t *masks, size_t npasses,
+                            size_t width, uint64_t bitmap)
+{
+   uint64_t valid = width_mask (width);
+   bitmap &= valid;
+   for (size_t i=0; i<npasses; i++) {
+      uint64_t ones = masks[i];
+      uint64_t zeros = ~ones & valid;
+      bitmap = _pext_u64 (bitmap, zeros)
+             | (_pext_u64 (bitmap, ones) << (_mm_popcnt_u64 (zeros) & 63));
+   }
+   return bitmap;
+}
+#endif
+
+// Software pext, for platforms without BMI2.
+static uint64_t soft_pext (uint64_t src, uint64_t mask)
+{
+   uint64_t ret = 0;
+   for (uint64_t bit = 1; mask; bit <<= 1) {
+      uint64_t lowest = mask & -mask;
+      if (src & lowest)
+         ret |= bit;
+      mask &= mask - 1;
+   }
+   return ret;
+}
+
+uint64_t askme_bitperm_apply_pext (const uint64_t *masks, size_t npasses,
+                                   size_t width, uint64_t bitmap)
+{
+#ifdef HAVE_PEXT_KERNEL
+   if (askme_bitperm_have_pext ())
+      return apply_pext (masks, npasses, width, bitmap);
+#endif
+
+   uint64_t valid = width_mask (width);
+   bitmap &= valid;
+   for (size_t i=0; i<npasses; i++) {
+      uint64_t ones = masks[i];
+      uint64_t zeros = ~ones & valid;
+      bitmap = soft_pext (bitmap, zeros)
+             | (soft_pext (bitmap, ones) << (__builtin_popcountll (zeros) & 63));
+   }
+   return bitmap;
+}
+
+bool askme_bitperm_have_pext (void)
+{
+#ifdef HAVE_PEXT_KERNEL
+   static int have = -1;
+   if (have < 0) {
+      __builtin_cpu_init ();
+      have = __builtin_cpu_supports ("bmi2") ? 1 : 0;
+   }
+   return have;
+#else
+   return false;
+#endif
+}
+
+uint64_t askme_bitperm_to_display (const askme_bitperm_t *bp, uint64_t bitmap)
+{
+   if (askme_bitperm_have_pext ())
+      return askme_bitperm_apply_pext (bp->display_masks, bp->npasses, bp->width, bitmap);
+
+   return askme_bitperm_apply_table (bp->to_display, bitmap & width_mask (bp->width));
+}
+
+uint64_t askme_bitperm_to_file (const askme_bitperm_t *bp, uint64_t bitmap)
+{
+   if (askme_bitperm_have_pext ())
+      return askme_bitperm_apply_pext (bp->file_masks, bp->npasses, bp->width, bitmap);
+
+   return askme_bitperm_apply_table (bp->to_file, bitmap & width_mask (bp->width));
+}
@@ -0,0 +1,171 @@
+
+#define _POSIX_C_SOURCE    200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#include "askme_lib.h"
+#include "askme_bitperm.h"
+
+/* Micro-benchmark of the option permutation kernels. For each option
+ * count a batch of random permutations and bitmaps is remapped by every
+ * kernel; the kernels are checked against each other and the time per
+ * remap is reported.
+ */
+
+#define DEFAULT_COUNT         (1000000)
+#define DEFAULT_ROUNDS        (10)
+
+static const size_t option_counts[] = { 4, 9, 16, 32, 62 };
+
+static double now_ns (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t xorshift (uint64_t *state)
+{
+   uint64_t x = *state;
+   x ^= x << 13;
+   x ^= x >> 7;
+   x ^= x << 17;
+   return *state = x;
+}
+
+// A sparse bitmap (a few options chosen) or a dense one (any options).
+static uint64_t random_bitmap (uint64_t *rng, size_t noptions, bool dense)
+{
+   uint64_t ret = 0;
+   if (dense) {
+      ret = xorshift (rng) << 1;
+   } else {
+      size_t nset = 1 + xorshift (rng) % 3;
+      for (size_t i=0; i<nset; i++) {
+         ASKME_SETBIT (ret, 1 + xorshift (rng) % noptions);
+      }
+   }
+   return ret & ((noptions >= 63 ? ~UINT64_C(0) : (UINT64_C(1) << (noptions + 1)) - 1));
+}
+
+static size_t read_size_option (const char *name, size_t defval)
+{
+   size_t ret = defval;
+   if (getenv (name) && ((sscanf (getenv (name), "%zu", &ret))!=1 || !ret)) {
+      ASKME_LOG ("Unable to read [%s] as a value for %s, using %zu\n",
+                 getenv (name), name, defval);
+      ret = defval;
+   }
+   return ret;
+}
+
+int main (int argc, char **argv)
+{
+   int ret = EXIT_FAILURE;
+   askme_bitperm_t *perms = NULL;
+   uint64_t *bitmaps = NULL;
+   uint64_t *results[3] = { NULL, NULL, NULL };
+   static const char *kernel_names[] = { "loop", "table", "pext" };
+   uint64_t rng = 88172645463325252ULL;
+
+   askme_read_cline (argc, argv);
+
+   if (getenv ("help")) {
+      printf ("askme_bitperm_bench: Benchmark the option permutation kernels\n"
+              "  --help            This message\n"
+              "  --count           Number of bitmaps remapped per round (default %i)\n"
+              "  --rounds          Number of timed rounds; the best is reported (default %i)\n",
+              DEFAULT_COUNT, DEFAULT_ROUNDS);
+      return EXIT_SUCCESS;
+   }
+
+   size_t count = read_size_option ("count", DEFAULT_COUNT);
+   size_t rounds = read_size_option ("rounds", DEFAULT_ROUNDS);
+
+   // A permutation per 64 bitmaps keeps the working set realistic
+   // without having the shuffle dominate the setup time.
+   size_t nperms = count / 64 + 1;
+
+   if (!(perms = calloc (nperms, sizeof *perms))
+         || !(bitmaps = calloc (count, sizeof *bitmaps))
+         || !(results[0] = calloc (count, sizeof *results[0]))
+         || !(results[1] = calloc (count, sizeof *results[1]))
+         || !(results[2] = calloc (count, sizeof *results[2]))) {
+      ASKME_LOG ("OOM error - cannot allocate %zu bitmaps\n", count);
+      goto errorexit;
+   }
+
+   printf ("BMI2 pext: %s\n", askme_bitperm_have_pext () ? "hardware" : "software fallback");
+   printf ("%8s %6s %10s %10s %10s   (ns per remap, best of %zu rounds of %zu)\n",
+           "options", "bits", kernel_names[0], kernel_names[1], kernel_names[2],
+           rounds, count);
+
+   for (size_t c=0; c<sizeof option_counts / sizeof option_counts[0]; c++) {
+      size_t noptions = option_counts[c];
+      for (int dense=0; dense<2; dense++) {
+         for (size_t i=0; i<nperms; i++) {
+            askme_bitperm_shuffle (&perms[i], noptions, 9, i);
+         }
+         for (size_t i=0; i<count; i++) {
+            bitmaps[i] = random_bitmap (&rng, noptions, dense);
+         }
+
+         double best[3] = { 1e300, 1e300, 1e300 };
+         for (size_t r=0; r<rounds; r++) {
+            for (size_t k=0; k<3; k++) {
+               double start = now_ns ();
+               for (size_t i=0; i<count; i++) {
+                  const askme_bitperm_t *bp = &perms[i / 64];
+                  switch (k) {
+                     case 0:
+                        results[k][i] = askme_bitperm_apply_loop (bp->to_display, bp->width,
+                                                                  bitmaps[i]);
+                        break;
+                     case 1:
+                        results[k][i] = askme_bitperm_apply_table (bp->to_display, bitmaps[i]);
+                        break;
+                     case 2:
+                        results[k][i] = askme_bitperm_apply_pext (bp->display_masks,
+                                                                  bp->npasses, bp->width,
+                                                                  bitmaps[i]);
+                        break;
+                  }
+               }
+               double elapsed = (now_ns () - start) / count;
+               if (elapsed < best[k])
+                  best[k] = elapsed;
+            }
+         }
+
+         for (size_t i=0; i<count; i++) {
+            const askme_bitperm_t *bp = &perms[i / 64];
+            if (results[0][i] != results[1][i] || results[0][i] != results[2][i]
+                  || askme_bitperm_to_file (bp, results[0][i]) != bitmaps[i]) {
+               ASKME_LOG ("Kernels disagree for %zu options, bitmap %zu: "
+                          "%016" PRIx64 " -> %016" PRIx64 " / %016" PRIx64 " / %016" PRIx64 "\n",
+                          noptions, i, bitmaps[i],
+                          results[0][i], results[1][i], results[2][i]);
+               goto errorexit;
+            }
+         }
+
+         printf ("%8zu %6s %10.2f %10.2f %10.2f\n", noptions, dense ? "dense" : "sparse",
+                 best[0], best[1], best[2]);
+      }
+   }
+
+   ret = EXIT_SUCCESS;
+
+errorexit:
+   free (perms);
+   free (bitmaps);
+   for (size_t k=0; k<3; k++) {
+      free (results[k]);
+   }
+   return ret;
+}
@@ -0,0 +1,289 @@
+
+#define _POSIX_C_SOURCE    200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "askme_lib.h"
+
+#include "ds_str.h"
+
+/* Stress test for askme_save_grade: many processes append grades to the
+ * same topic at the same time. Every writer records its own id in the
+ * 'correct' field and its sequence number in the 'total' field, so that
+ * afterwards every line can be checked for tearing and every record
+ * accounted for exactly once.
+ *
+ * The test runs in a private home directory made with mkdtemp() so
+ * that it can never touch the grades of the user running it.
+ */
+
+#define DEFAULT_WRITERS       (200)
+#define DEFAULT_APPENDS       (100)
+#define DEFAULT_TOPIC         ".grade-stress"
+#define HOME_TEMPLATE         "/askme-grade-stress-XXXXXX"
+
+static size_t read_size_option (const char *name, size_t defval)
+{
+   size_t ret = defval;
+   if (getenv (name) && ((sscanf (getenv (name), "%zu", &ret))!=1 || !ret)) {
+      ASKME_LOG ("Unable to read [%s] as a value for %s, using %zu\n",
+                 getenv (name), name, defval);
+      ret = defval;
+   }
+   return ret;
+}
+
+static double now_seconds (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Makes an empty directory under $TMPDIR (or /tmp) to use as $HOME.
+static char *make_private_home (void)
+{
+   const char *tmpdir = getenv ("TMPDIR");
+   char *ret = ds_str_cat (tmpdir && tmpdir[0] ? tmpdir : "/tmp", HOME_TEMPLATE, NULL);
+
+   if (!ret) {
+      ASKME_LOG ("OOM error - unable to create pathname for the test directory\n");
+      return NULL;
+   }
+   if (!(mkdtemp (ret))) {
+      ASKME_LOG ("Failed to create [%s]: %m\n", ret);
+      free (ret);
+      return NULL;
+   }
+   return ret;
+}
+
+static void remove_tree (const char *path)
+{
+   DIR *dir = opendir (path);
+   struct dirent *de;
+
+   while (dir && (de = readdir (dir))) {
+      if ((strcmp (de->d_name, "."))==0 || (strcmp (de->d_name, ".."))==0)
+         continue;
+
+      char *child = ds_str_cat (path, "/", de->d_name, NULL);
+      struct stat sb;
+      if (child && (lstat (child, &sb))==0) {
+         if (S_ISDIR (sb.st_mode)) {
+            remove_tree (child);
+         } else if ((unlink (child))!=0) {
+            ASKME_LOG ("Failed to remove [%s]: %m\n", child);
+         }
+      }
+      free (child);
+   }
+   if (dir)
+      closedir (dir);
+
+   if ((rmdir (path))!=0) {
+      ASKME_LOG ("Failed to remove [%s]: %m\n", path);
+   }
+}
+
+// The writer blocks until the parent closes the start pipe, so that all
+// the writers start appending at the same moment.
+static void writer (int start_fd, const char *topic, size_t id, size_t nappends)
+{
+   char c;
+   while ((read (start_fd, &c, 1)) > 0)
+      ;
+   close (start_fd);
+
+   size_t failures = 0;
+   for (size_t seq=1; seq<=nappends; seq++) {
+      if (!(askme_save_grade (topic, id, seq)))
+         failures++;
+   }
+   _exit (failures ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+// Checks every line of the grades file. Returns the number of problems.
+static size_t verify (const char *fname, size_t nwriters, size_t nappends)
+{
+   size_t problems = 0;
+   size_t linenum = 0;
+   char *line = NULL;
+   size_t line_len = 0;
+   uint8_t *seen = NULL;
+   FILE *inf = NULL;
+
+   if (!(seen = calloc (nwriters * nappends, sizeof *seen))) {
+      ASKME_LOG ("OOM error - cannot allocate %zu records\n", nwriters * nappends);
+      return 1;
+   }
+
+   if (!(inf = fopen (fname, "rt"))) {
+      ASKME_LOG ("Failed to open [%s]: %m\n", fname);
+      free (seen);
+      return 1;
+   }
+
+   while ((getline (&line, &line_len, inf)) > 0) {
+      linenum++;
+      uint64_t epoch;
+      char display[50];
+      size_t id, seq;
+      unsigned int perc;
+      char extra;
+
+      if (!strchr (line, '\n')) {
+         printf ("%s:%zu: torn record (no newline)\n", fname, linenum);
+         problems++;
+         continue;
+      }
+      if ((sscanf (line, "%" SCNu64 "\t%49[^\t]\t%zu\t%zu\t%u\n%c",
+                   &epoch, display, &id, &seq, &perc, &extra))!=5
+            || !id-- || id >= nwriters || !seq-- || seq >= nappends) {
+         printf ("%s:%zu: torn or malformed record [%s]\n", fname, linenum, line);
+         problems++;
+         continue;
+      }
+      if (seen[id * nappends + seq]++) {
+         printf ("%s:%zu: duplicate record for writer %zu, append %zu\n",
+                 fname, linenum, id + 1, seq + 1);
+         problems++;
+      }
+   }
+
+   for (size_t i=0; i<nwriters * nappends; i++) {
+      if (!seen[i]) {
+         printf ("Lost record for writer %zu, append %zu\n",
+                 i / nappends + 1, i % nappends + 1);
+         problems++;
+      }
+   }
+
+   free (line);
+   free (seen);
+   fclose (inf);
+   return problems;
+}
+
+static const char *help_msg[] = {
+"askme_grade_stress: Concurrent grade appends stress test",
+"  --help            This message",
+"  --writers         Number of concurrent writer processes (default 200)",
+"  --appends         Number of grades each writer appends (default 100)",
+"  --topic           Topic to write grades for (default " DEFAULT_TOPIC ")",
+"  --keep            Keep the test directory and grades file afterwards",
+"",
+"  All the writers append to the same grades file at the same time. The",
+"file is then checked for torn, duplicated and lost records and the",
+"number of appends per second is reported.",
+"",
+"  The test runs with $HOME set to a new directory in $TMPDIR (or /tmp),",
+"so the grades in the real $HOME are never touched.",
+NULL,
+};
+
+int main (int argc, char **argv)
+{
+   int ret = EXIT_FAILURE;
+   int start_pipe[2] = { -1, -1 };
+   char *fname = NULL;
+   char *home = NULL;
+   size_t nstarted = 0;
+   size_t failed_writers = 0;
+
+   askme_read_cline (argc, argv);
+
+   if (getenv ("help")) {
+      for (size_t i=0; help_msg[i]; i++) {
+         printf ("%s\n", help_msg[i]);
+      }
+      return EXIT_SUCCESS;
+   }
+
+   size_t nwriters = read_size_option ("writers", DEFAULT_WRITERS);
+   size_t nappends = read_size_option ("appends", DEFAULT_APPENDS);
+   const char *topic = getenv ("topic") ? getenv ("topic") : DEFAULT_TOPIC;
+
+   // The writers inherit the private $HOME
+   if (!(home = make_private_home ())
+         || (setenv ("HOME", home, 1))!=0) {
+      goto errorexit;
+   }
+
+   if (!(fname = askme_get_subdir ("grades/", topic, NULL))) {
+      ASKME_LOG ("OOM error - unable to create pathname [grades/%s]\n", topic);
+      goto errorexit;
+   }
+
+   if ((pipe (start_pipe))!=0) {
+      ASKME_LOG ("Failed to create pipe: %m\n");
+      goto errorexit;
+   }
+
+   fflush (stdout);
+   for (nstarted=0; nstarted<nwriters; nstarted++) {
+      pid_t pid = fork ();
+      if (pid < 0) {
+         ASKME_LOG ("Failed to start writer %zu: %m\n", nstarted + 1);
+         break;
+      }
+      if (pid == 0) {
+         close (start_pipe[1]);
+         writer (start_pipe[0], topic, nstarted + 1, nappends);
+      }
+   }
+
+   double start = now_seconds ();
+   close (start_pipe[1]);
+   start_pipe[1] = -1;
+
+   int status;
+   while ((wait (&status)) > 0) {
+      if (!WIFEXITED (status) || WEXITSTATUS (status) != EXIT_SUCCESS)
+         failed_writers++;
+   }
+   double elapsed = now_seconds () - start;
+
+   if (nstarted != nwriters) {
+      goto errorexit;
+   }
+
+   size_t total = nwriters * nappends;
+   printf ("%zu writers x %zu appends: %zu records in %.3fs (%.0f appends/s)\n",
+           nwriters, nappends, total, elapsed, total / elapsed);
+
+   size_t problems = verify (fname, nwriters, nappends);
+   printf ("%zu writers reported errors, %zu problems found in [%s]\n",
+           failed_writers, problems, fname);
+
+   if (!problems && !failed_writers) {
+      ret = EXIT_SUCCESS;
+   }
+
+errorexit:
+   if (start_pipe[0] >= 0)
+      close (start_pipe[0]);
+   if (start_pipe[1] >= 0)
+      close (start_pipe[1]);
+
+   if (home && getenv ("keep")) {
+      printf ("Kept [%s]\n", home);
+   } else if (home) {
+      remove_tree (home);
+   }
+   free (fname);
+   free (home);
+
+   return ret;
+}
@@ -0,0 +1,334 @@
+
+#define _POSIX_C_SOURCE    200809L
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include <unistd.h>
+
+#include "askme_lib.h"
+#include "askme_history.h"
+
+#include "ds_str.h"
+
+#define HISTORY_MAGIC      "ASKMEHS1"
+
+static const char *set_names[ASKME_HISTORY_NSETS] = {
+   "seen", "wrong", "retry", "flagged",
+};
+
+askme_history_t *askme_history_load (const char *topic)
+{
+   askme_history_t *ret = NULL;
+   FILE *inf = NULL;
+   char magic[8];
+
+   if (!(ret = calloc (1, sizeof *ret))) {
+      ASKME_LOG ("OOM error - cannot allocate history\n");
+      return NULL;
+   }
+
+   if (!(ret->path = askme_get_subdir ("history/", topic, NULL))) {
+      ASKME_LOG ("OOM error - unable to create pathname [history/%s]\n", topic);
+      goto errorexit;
+   }
+
+   if (!(inf = fopen (ret->path, "rb"))) {
+      if (errno != ENOENT) {
+         ASKME_LOG ("Failed to open [%s]: %m\n", ret->path);
+         goto errorexit;
+      }
+      for (size_t i=0; i<ASKME_HISTORY_NSETS; i++) {
+         if (!(ret->sets[i] = askme_qset_new ()))
+            goto errorexit;
+      }
+      return ret;
+   }
+
+   if ((fread (magic, sizeof magic, 1, inf))!=1
+         || (memcmp (magic, HISTORY_MAGIC, sizeof magic))!=0) {
+      ASKME_LOG ("[%s] is not a history file\n", ret->path);
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<ASKME_HISTORY_NSETS; i++) {
+      if (!(ret->sets[i] = askme_qset_read (inf))) {
+         ASKME_LOG ("Failed to read the [%s] set from [%s]\n", set_names[i], ret->path);
+         goto errorexit;
+      }
+   }
+
+   fclose (inf);
+   return ret;
+
+errorexit:
+   if (inf)
+      fclose (inf);
+   askme_history_del (ret);
+   return NULL;
+}
+
+// Written to a temporary file which then replaces the history, so that
+// readers only ever see a complete history.
+bool askme_history_save (const askme_history_t *history)
+{
+   bool error = true;
+   char *tmpname = NULL;
+   FILE *outf = NULL;
+
+   if (!(tmpname = ds_str_cat (history->path, ".tmp", NULL))) {
+      ASKME_LOG ("OOM error - unable to create pathname [%s.tmp]\n", history->path);
+      goto errorexit;
+   }
+
+   if (!(outf = fopen (tmpname, "wb"))) {
+      ASKME_LOG ("Failed to open [%s]: %m\n", tmpname);
+      goto errorexit;
+   }
+
+   if ((fwrite (HISTORY_MAGIC, 8, 1, outf))!=1) {
+      ASKME_LOG ("Failed to write [%s]: %m\n", tmpname);
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<ASKME_HISTORY_NSETS; i++) {
+      if (!(askme_qset_write (history->sets[i], outf))) {
+         ASKME_LOG ("Failed to write [%s]: %m\n", tmpname);
+         goto errorexit;
+      }
+   }
+
+   int rc = fclose (outf);
+   outf = NULL;
+   if (rc!=0) {
+      ASKME_LOG ("Failed to write [%s]: %m\n", tmpname);
+      goto errorexit;
+   }
+
+   if ((rename (tmpname, history->path))!=0) {
+      ASKME_LOG ("Failed to rename [%s] to [%s]: %m\n", tmpname, history->path);
+      goto errorexit;
+   }
+
+   error = false;
+
+errorexit:
+   if (outf) {
+      fclose (outf);
+   }
+   if (error && tmpname) {
+      unlink (tmpname);
+   }
+   free (tmpname);
+   return !error;
+}
+
+void askme_history_del (askme_history_t *history)
+{
+   if (!history)
+      return;
+
+   for (size_t i=0; i<ASKME_HISTORY_NSETS; i++) {
+      askme_qset_del (history->sets[i]);
+   }
+   free (history->path);
+   free (history);
+}
+
+// The sets hold 32-bit indexes; anything larger would be recorded
+// against some other question.
+static bool question_valid (const askme_history_t *history, size_t question)
+{
+   if (question > UINT32_MAX) {
+      ASKME_LOG ("Question %zu is out of range for the history [%s]\n", question, history->path);
+      return false;
+   }
+   return true;
+}
+
+bool askme_history_grade (askme_history_t *history, size_t question, bool correct)
+{
+   if (!(question_valid (history, question)))
+      return false;
+
+   if (!(askme_qset_add (history->sets[ASKME_HISTORY_SEEN], question)))
+      return false;
+
+   if (correct)
+      return askme_qset_remove (history->sets[ASKME_HISTORY_RETRY], question);
+
+   return askme_qset_add (history->sets[ASKME_HISTORY_WRONG], question)
+       && askme_qset_add (history->sets[ASKME_HISTORY_RETRY], question);
+}
+
+bool askme_history_flagged (const askme_history_t *history, size_t question)
+{
+   return question <= UINT32_MAX
+       && askme_qset_contains (history->sets[ASKME_HISTORY_FLAGGED], question);
+}
+
+bool askme_history_flag (askme_history_t *history, size_t question, bool flagged)
+{
+   if (!(question_valid (history, question)))
+      return false;
+
+   if (flagged)
+      return askme_qset_add (history->sets[ASKME_HISTORY_FLAGGED], question);
+   return askme_qset_remove (history->sets[ASKME_HISTORY_FLAGGED], question);
+}
+
+/* ******************************************************************** */
+
+struct parser_t {
+   const char *expr;
+   const char *pos;
+   const askme_history_t *history;
+   const askme_qset_t *all;
+};
+
+static askme_qset_t *parse_union (struct parser_t *parser);
+
+static char next_token (struct parser_t *parser)
+{
+   while (isspace (*parser->pos)) {
+      parser->pos++;
+   }
+   return *parser->pos;
+}
+
+static askme_qset_t *parse_name (struct parser_t *parser)
+{
+   const char *start = parser->pos;
+   size_t len = 0;
+
+   while (isalpha (start[len])) {
+      len++;
+   }
+   parser->pos += len;
+
+   for (size_t i=0; i<ASKME_HISTORY_NSETS; i++) {
+      if (strlen (set_names[i]) == len && (memcmp (start, set_names[i], len))==0) {
+         return askme_qset_copy (parser->history->sets[i]);
+      }
+   }
+   if (len == 6 && (memcmp (start, "unseen", len))==0) {
+      return askme_qset_andnot (parser->all, parser->history->sets[ASKME_HISTORY_SEEN]);
+   }
+   if (len == 3 && (memcmp (start, "all", len))==0) {
+      return askme_qset_copy (parser->all);
+   }
+
+   ASKME_LOG ("Unknown set [%.*s] at offset %zu of [%s]\n",
+              (int)len, start, (size_t)(start - parser->expr), parser->expr);
+   return NULL;
+}
+
+static askme_qset_t *parse_unary (struct parser_t *parser)
+{
+   askme_qset_t *ret = NULL;
+   askme_qset_t *tmp = NULL;
+
+   switch (next_token (parser)) {
+      case '!':
+         parser->pos++;
+         if (!(tmp = parse_unary (parser)))
+            return NULL;
+         ret = askme_qset_andnot (parser->all, tmp);
+         askme_qset_del (tmp);
+         return ret;
+
+      case '(':
+         parser->pos++;
+         if (!(ret = parse_union (parser)))
+            return NULL;
+         if (next_token (parser) != ')') {
+            ASKME_LOG ("Expected ')' at offset %zu of [%s]\n",
+                       (size_t)(parser->pos - parser->expr), parser->expr);
+            askme_qset_del (ret);
+            return NULL;
+         }
+         parser->pos++;
+         return ret;
+   }
+
+   return parse_name (parser);
+}
+
+static askme_qset_t *parse_intersection (struct parser_t *parser)
+{
+   askme_qset_t *ret = parse_unary (parser);
+   char op;
+
+   while (ret && ((op = next_token (parser)) == '&' || op == '-')) {
+      askme_qset_t *rhs = NULL;
+      askme_qset_t *tmp = NULL;
+
+      parser->pos++;
+      if ((rhs = parse_unary (parser))) {
+         tmp = op == '&' ? askme_qset_and (ret, rhs) : askme_qset_andnot (ret, rhs);
+      }
+      askme_qset_del (rhs);
+      askme_qset_del (ret);
+      ret = tmp;
+   }
+
+   return ret;
+}
+
+static askme_qset_t *parse_union (struct parser_t *parser)
+{
+   askme_qset_t *ret = parse_intersection (parser);
+
+   while (ret && next_token (parser) == '|') {
+      askme_qset_t *rhs = NULL;
+      askme_qset_t *tmp = NULL;
+
+      parser->pos++;
+      if ((rhs = parse_intersection (parser))) {
+         tmp = askme_qset_or (ret, rhs);
+      }
+      askme_qset_del (rhs);
+      askme_qset_del (ret);
+      ret = tmp;
+   }
+
+   return ret;
+}
+
+askme_qset_t *askme_history_select (const askme_history_t *history, const char *expr,
+                                    size_t nquestions)
+{
+   askme_qset_t *all = NULL;
+   askme_qset_t *result = NULL;
+   askme_qset_t *ret = NULL;
+
+   if (nquestions > UINT32_MAX) {
+      ASKME_LOG ("Cannot select from more than %" PRIu32 " questions\n", UINT32_MAX);
+      return NULL;
+   }
+
+   if (!(all = askme_qset_range (nquestions)))
+      return NULL;
+
+   struct parser_t parser = { expr, expr, history, all };
+   if ((result = parse_union (&parser)) && next_token (&parser)) {
+      ASKME_LOG ("Unexpected [%s] at offset %zu of [%s]\n",
+                 parser.pos, (size_t)(parser.pos - expr), expr);
+      goto errorexit;
+   }
+
+   // The history may know of questions that have since been removed
+   if (result) {
+      ret = askme_qset_and (result, all);
+   }
+
+errorexit:
+   askme_qset_del (result);
+   askme_qset_del (all);
+   return ret;
+}
+
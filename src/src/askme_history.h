@@ -0,0 +1,65 @@
+#ifndef H_ASKME_HISTORY
+#define H_ASKME_HISTORY
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "askme_qset.h"
+
+/* What is known about each question of a topic, kept as sets of question
+ * indexes in ~/.askme/history/<topic>:
+ *    seen:       questions that have been graded at least once;
+ *    wrong:      questions that have ever been answered wrongly;
+ *    retry:      questions that were answered wrongly the last time they
+ *                were asked;
+ *    flagged:    questions flagged by the user while answering them.
+ *
+ * A selection is an expression over these sets, plus 'unseen' (every
+ * question not in 'seen') and 'all', using '&' (intersection), '|'
+ * (union), '-' (difference), '!' (complement) and parentheses. '!' binds
+ * tightest, then '&' and '-', then '|', so 'retry|unseen&flagged' is
+ * 'retry|(unseen&flagged)'.
+ */
+
+enum askme_history_set_t {
+   ASKME_HISTORY_SEEN,
+   ASKME_HISTORY_WRONG,
+   ASKME_HISTORY_RETRY,
+   ASKME_HISTORY_FLAGGED,
+   ASKME_HISTORY_NSETS,
+};
+
+typedef struct askme_history_t askme_history_t;
+struct askme_history_t {
+   char *path;
+   askme_qset_t *sets[ASKME_HISTORY_NSETS];
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // A topic without any history yet gets empty sets.
+   askme_history_t *askme_history_load (const char *topic);
+   bool askme_history_save (const askme_history_t *history);
+   void askme_history_del (askme_history_t *history);
+
+   // Records the grade of a single answer to the question. Questions
+   // past UINT32_MAX are refused, as are attempts to flag them.
+   bool askme_history_grade (askme_history_t *history, size_t question, bool correct);
+
+   bool askme_history_flagged (const askme_history_t *history, size_t question);
+   bool askme_history_flag (askme_history_t *history, size_t question, bool flagged);
+
+   // Evaluates the selection for a topic of nquestions questions. Returns
+   // NULL if the expression cannot be parsed.
+   askme_qset_t *askme_history_select (const askme_history_t *history, const char *expr,
+                                       size_t nquestions);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
+
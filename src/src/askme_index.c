@@ -0,0 +1,371 @@
+
+#define _POSIX_C_SOURCE    200809L
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "askme_lib.h"
+#include "askme_index.h"
+
+#include "ds_str.h"
+
+#define INDEX_MAGIC           "ASKMEIX4"
+#define SCAN_BUFFER_SIZE      (64 * 1024)
+
+struct index_header_t {
+   char magic[8];
+   uint64_t topic_size;
+   int64_t topic_mtime_sec;
+   int64_t topic_mtime_nsec;
+   uint64_t nrecords;
+   uint64_t complete_len;     // Bytes up to and including the last newline
+   askme_hash_t hash;         // Of the first hash.len bytes of the topic
+};
+
+struct askme_index_t {
+   char *topic_path;
+   char *index_path;
+   FILE *topicf;
+   int index_fd;
+   struct index_header_t header;
+   char *line;
+   size_t line_len;
+};
+
+static bool header_valid (const struct index_header_t *header)
+{
+   return (memcmp (header->magic, INDEX_MAGIC, sizeof header->magic))==0;
+}
+
+static bool header_matches (const struct index_header_t *header, const struct stat *sb)
+{
+   return header_valid (header)
+       && header->topic_size == (uint64_t)sb->st_size
+       && header->topic_mtime_sec == (int64_t)sb->st_mtim.tv_sec
+       && header->topic_mtime_nsec == (int64_t)sb->st_mtim.tv_nsec;
+}
+
+static bool read_header (int fd, struct index_header_t *header)
+{
+   return (pread (fd, header, sizeof *header, 0)) == (ssize_t)sizeof *header;
+}
+
+// Scans the topic from header->complete_len to the end, writing the
+// offset of every record found to outf (which must be positioned just
+// after the offsets already in the index) and updating the header. The
+// offsets are streamed out as they are found, so this runs in constant
+// memory. Bytes past those already in header->hash are added to it, so
+// that the hash covers everything that was scanned. A last line without
+// its newline is hashed but not indexed; it is scanned again once the
+// newline arrives.
+static bool index_scan (askme_index_t *idx, FILE *outf, struct index_header_t *header)
+{
+   bool error = true;
+   char *buf = NULL;
+   uint64_t offset = header->complete_len;
+   uint64_t line_start = offset;
+   bool has_content = false;
+   size_t nbytes;
+
+   if (!(buf = malloc (SCAN_BUFFER_SIZE))) {
+      ASKME_LOG ("OOM error - unable to allocate scan buffer\n");
+      goto errorexit;
+   }
+
+   if ((fseeko (idx->topicf, offset, SEEK_SET))!=0) {
+      ASKME_LOG ("Failed to seek in [%s]: %m\n", idx->topic_path);
+      goto errorexit;
+   }
+
+   while ((nbytes = fread (buf, 1, SCAN_BUFFER_SIZE, idx->topicf)) > 0) {
+      if (offset + nbytes > header->hash.len) {
+         size_t skip = header->hash.len - offset;
+         askme_hash_update (&header->hash, &buf[skip], nbytes - skip);
+      }
+      for (size_t i=0; i<nbytes; i++, offset++) {
+         if (buf[i] == '\n') {
+            if (has_content) {
+               if ((fwrite (&line_start, sizeof line_start, 1, outf))!=1) {
+                  ASKME_LOG ("Failed to write [%s]: %m\n", idx->index_path);
+                  goto errorexit;
+               }
+               header->nrecords++;
+            }
+            line_start = offset + 1;
+            has_content = false;
+         } else if (buf[i] != '\t') {
+            has_content = true;
+         }
+      }
+   }
+   if (ferror (idx->topicf)) {
+      ASKME_LOG ("Failed to read [%s]: %m\n", idx->topic_path);
+      goto errorexit;
+   }
+
+   header->complete_len = line_start;
+   error = false;
+
+errorexit:
+   free (buf);
+   return !error;
+}
+
+static void header_init (struct index_header_t *header, const struct stat *sb)
+{
+   memcpy (header->magic, INDEX_MAGIC, sizeof header->magic);
+   header->topic_size = sb->st_size;
+   header->topic_mtime_sec = sb->st_mtim.tv_sec;
+   header->topic_mtime_nsec = sb->st_mtim.tv_nsec;
+}
+
+// Scans the whole topic file into a temporary file which then replaces
+// the index.
+static bool index_rebuild (askme_index_t *idx, const struct stat *sb)
+{
+   bool error = true;
+   char *tmpname = NULL;
+   FILE *outf = NULL;
+   struct index_header_t header;
+
+   memset (&header, 0, sizeof header);
+   header_init (&header, sb);
+   askme_hash_init (&header.hash);
+
+   if (!(tmpname = ds_str_cat (idx->index_path, ".tmp", NULL))) {
+      ASKME_LOG ("OOM error - unable to create pathname [%s.tmp]\n", idx->index_path);
+      goto errorexit;
+   }
+
+   if (!(outf = fopen (tmpname, "wb"))) {
+      ASKME_LOG ("Failed to open [%s]: %m\n", tmpname);
+      goto errorexit;
+   }
+
+   // Written again at the end, once the record count is known.
+   if ((fwrite (&header, sizeof header, 1, outf))!=1) {
+      ASKME_LOG ("Failed to write [%s]: %m\n", tmpname);
+      goto errorexit;
+   }
+
+   if (!(index_scan (idx, outf, &header))) {
+      goto errorexit;
+   }
+
+   rewind (outf);
+   if ((fwrite (&header, sizeof header, 1, outf))!=1) {
+      ASKME_LOG ("Failed to write [%s]: %m\n", tmpname);
+      goto errorexit;
+   }
+
+   int rc = fclose (outf);
+   outf = NULL;
+   if (rc!=0) {
+      ASKME_LOG ("Failed to write [%s]: %m\n", tmpname);
+      goto errorexit;
+   }
+
+   if ((rename (tmpname, idx->index_path))!=0) {
+      ASKME_LOG ("Failed to rename [%s] to [%s]: %m\n", tmpname, idx->index_path);
+      goto errorexit;
+   }
+
+   error = false;
+
+errorexit:
+   if (outf) {
+      fclose (outf);
+   }
+   if (error && tmpname) {
+      unlink (tmpname);
+   }
+   free (tmpname);
+   return !error;
+}
+
+// The topic has only had records appended since it was last indexed:
+// scan just the new tail and append its offsets to the index in place. The header is written last,
+// so an update that is interrupted leaves a header that does not match
+// the topic and the next open simply does the update again.
+static bool index_update (askme_index_t *idx, const struct stat *sb)
+{
+   bool error = true;
+   FILE *outf = NULL;
+   struct index_header_t header = idx->header;
+
+   header_init (&header, sb);
+
+   if (!(outf = fopen (idx->index_path, "r+b"))) {
+      ASKME_LOG ("Failed to open [%s]: %m\n", idx->index_path);
+      goto errorexit;
+   }
+
+   off_t end = sizeof header + header.nrecords * sizeof (uint64_t);
+   if ((fseeko (outf, end, SEEK_SET))!=0) {
+      ASKME_LOG ("Failed to seek in [%s]: %m\n", idx->index_path);
+      goto errorexit;
+   }
+
+   if (!(index_scan (idx, outf, &header))) {
+      goto errorexit;
+   }
+
+   if ((fflush (outf))!=0
+         || (ftruncate (fileno (outf), sizeof header + header.nrecords * sizeof (uint64_t)))!=0) {
+      ASKME_LOG ("Failed to write [%s]: %m\n", idx->index_path);
+      goto errorexit;
+   }
+
+   rewind (outf);
+   if ((fwrite (&header, sizeof header, 1, outf))!=1) {
+      ASKME_LOG ("Failed to write [%s]: %m\n", idx->index_path);
+      goto errorexit;
+   }
+
+   int rc = fclose (outf);
+   outf = NULL;
+   if (rc!=0) {
+      ASKME_LOG ("Failed to write [%s]: %m\n", idx->index_path);
+      goto errorexit;
+   }
+
+   error = false;
+
+errorexit:
+   if (outf) {
+      fclose (outf);
+   }
+   return !error;
+}
+
+// True if the topic still starts with exactly what was indexed. This
+// reads everything that was indexed, but hashing runs at close to
+// memory speed, far faster than scanning for records.
+static bool only_appended (askme_index_t *idx, const struct stat *sb)
+{
+   askme_hash_t hash;
+
+   if (!header_valid (&idx->header)
+         || (uint64_t)sb->st_size < idx->header.hash.len
+         || idx->header.hash.len < idx->header.complete_len) {
+      return false;
+   }
+
+   askme_hash_init (&hash);
+   return askme_hash_file (&hash, fileno (idx->topicf), 0, idx->header.hash.len)
+       && askme_hash_final (&hash) == askme_hash_final (&idx->header.hash);
+}
+
+askme_index_t *askme_index_open (const char *topic)
+{
+   askme_index_t *ret = NULL;
+   struct stat sb;
+
+   if (!(ret = calloc (1, sizeof *ret))) {
+      ASKME_LOG ("OOM error - cannot allocate index\n");
+      return NULL;
+   }
+   ret->index_fd = -1;
+
+   if (!(ret->topic_path = askme_get_subdir ("topics/", topic, NULL))
+         || !(ret->index_path = askme_get_subdir ("index/", topic, NULL))) {
+      ASKME_LOG ("OOM error - unable to create pathnames for [%s]\n", topic);
+      goto errorexit;
+   }
+
+   if (!(ret->topicf = fopen (ret->topic_path, "rb"))) {
+      ASKME_LOG ("Failed to open [%s]: %m\n", ret->topic_path);
+      goto errorexit;
+   }
+
+   if ((fstat (fileno (ret->topicf), &sb))!=0) {
+      ASKME_LOG ("Failed to stat [%s]: %m\n", ret->topic_path);
+      goto errorexit;
+   }
+
+   if ((ret->index_fd = open (ret->index_path, O_RDONLY)) >= 0
+         && read_header (ret->index_fd, &ret->header)
+         && header_matches (&ret->header, &sb)) {
+      return ret;
+   }
+
+   bool updated = ret->index_fd >= 0
+               && only_appended (ret, &sb)
+               && index_update (ret, &sb);
+
+   if (ret->index_fd >= 0) {
+      close (ret->index_fd);
+      ret->index_fd = -1;
+   }
+
+   if (!updated && !(index_rebuild (ret, &sb))) {
+      goto errorexit;
+   }
+
+   if ((ret->index_fd = open (ret->index_path, O_RDONLY)) < 0
+         || !(read_header (ret->index_fd, &ret->header))) {
+      ASKME_LOG ("Failed to read [%s]: %m\n", ret->index_path);
+      goto errorexit;
+   }
+
+   return ret;
+
+errorexit:
+   askme_index_close (ret);
+   return NULL;
+}
+
+void askme_index_close (askme_index_t *idx)
+{
+   if (!idx)
+      return;
+
+   if (idx->topicf)
+      fclose (idx->topicf);
+   if (idx->index_fd >= 0)
+      close (idx->index_fd);
+
+   free (idx->line);
+   free (idx->topic_path);
+   free (idx->index_path);
+   free (idx);
+}
+
+size_t askme_index_count (const askme_index_t *idx)
+{
+   return idx ? idx->header.nrecords : 0;
+}
+
+char *askme_index_read (askme_index_t *idx, size_t record)
+{
+   uint64_t offset;
+
+   if (record >= idx->header.nrecords) {
+      ASKME_LOG ("Record %zu is out of range for [%s]\n", record, idx->topic_path);
+      return NULL;
+   }
+
+   off_t pos = sizeof idx->header + record * sizeof offset;
+   if ((pread (idx->index_fd, &offset, sizeof offset, pos))!=(ssize_t)sizeof offset) {
+      ASKME_LOG ("Failed to read record %zu from [%s]: %m\n", record, idx->index_path);
+      return NULL;
+   }
+
+   if ((fseeko (idx->topicf, offset, SEEK_SET))!=0
+         || (getline (&idx->line, &idx->line_len, idx->topicf)) < 0) {
+      ASKME_LOG ("Failed to read record %zu from [%s]: %m\n", record, idx->topic_path);
+      return NULL;
+   }
+
+   char *nl = strchr (idx->line, '\n');
+   if (nl)
+      *nl = 0;
+
+   return ds_str_dup (idx->line);
+}
@@ -0,0 +1,553 @@
+
+#define _POSIX_C_SOURCE    200809L
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "askme_lib.h"
+#include "askme_journal.h"
+
+#include "ds_str.h"
+
+#define DEFAULT_SYNC_COUNT       (16)
+#define DEFAULT_SYNC_MS          (1000)
+
+struct askme_journal_t {
+   int fd;
+   char *path;
+   size_t sync_count;
+   uint64_t sync_ms;
+
+   // The flusher thread syncs the journal once the oldest unsynced
+   // record is sync_ms old. Everything below is protected by lock.
+   pthread_mutex_t lock;
+   pthread_cond_t wakeup;
+   pthread_t flusher;
+   bool have_flusher;
+   bool stopping;
+   size_t pending;            // Records written since the last sync
+   struct timespec deadline;  // When the oldest pending record must be synced
+};
+
+static bool journal_sync_locked (askme_journal_t *journal)
+{
+   if (!journal->pending)
+      return true;
+
+   if ((fdatasync (journal->fd))!=0) {
+      ASKME_LOG ("Failed to sync [%s]: %m\n", journal->path);
+      return false;
+   }
+   journal->pending = 0;
+   return true;
+}
+
+static void *flusher (void *arg)
+{
+   askme_journal_t *journal = arg;
+
+   pthread_mutex_lock (&journal->lock);
+   while (!journal->stopping) {
+      if (!journal->pending) {
+         pthread_cond_wait (&journal->wakeup, &journal->lock);
+         continue;
+      }
+      int rc = pthread_cond_timedwait (&journal->wakeup, &journal->lock, &journal->deadline);
+      if (rc == ETIMEDOUT && !journal->stopping) {
+         journal_sync_locked (journal);
+      }
+   }
+   pthread_mutex_unlock (&journal->lock);
+
+   return NULL;
+}
+
+static size_t read_setting (const char *name, size_t defval)
+{
+   size_t ret = defval;
+   const char *value = getenv (name);
+   if (value && (sscanf (value, "%zu", &ret))!=1) {
+      ASKME_LOG ("Failed to read [%s] as a value for %s, using %zu\n", value, name, defval);
+      ret = defval;
+   }
+   return ret;
+}
+
+// A length of -1 leaves the file as it is.
+static askme_journal_t *journal_open (const char *topic, int flags, off_t length)
+{
+   askme_journal_t *ret = NULL;
+
+   if (!(ret = calloc (1, sizeof *ret))) {
+      ASKME_LOG ("OOM error - cannot allocate journal\n");
+      return NULL;
+   }
+   ret->fd = -1;
+   pthread_mutex_init (&ret->lock, NULL);
+
+   // The deadlines are on the monotonic clock so that changes to the
+   // wall clock cannot hold a sync back.
+   pthread_condattr_t attr;
+   pthread_condattr_init (&attr);
+   pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+   pthread_cond_init (&ret->wakeup, &attr);
+   pthread_condattr_destroy (&attr);
+
+   if (!(ret->path = askme_get_subdir ("sessions/", topic, NULL))) {
+      ASKME_LOG ("OOM error - unable to create pathname [sessions/%s]\n", topic);
+      goto errorexit;
+   }
+
+   if ((ret->fd = open (ret->path, O_WRONLY | O_APPEND | flags, 0644)) < 0) {
+      ASKME_LOG ("Failed to open [%s]: %m\n", ret->path);
+      goto errorexit;
+   }
+
+   if (length >= 0 && (ftruncate (ret->fd, length))!=0) {
+      ASKME_LOG ("Failed to truncate [%s] to %" PRIu64 " bytes: %m\n",
+                 ret->path, (uint64_t)length);
+      goto errorexit;
+   }
+
+   ret->sync_count = read_setting ("journal-sync-count", DEFAULT_SYNC_COUNT);
+   ret->sync_ms = read_setting ("journal-sync-ms", DEFAULT_SYNC_MS);
+
+   if (ret->sync_ms && ret->sync_count > 1) {
+      if ((pthread_create (&ret->flusher, NULL, flusher, ret))!=0) {
+         ASKME_LOG ("Failed to start the journal flusher, syncing every record\n");
+         ret->sync_count = 1;
+      } else {
+         ret->have_flusher = true;
+      }
+   }
+
+   return ret;
+
+errorexit:
+   askme_journal_close (ret, false);
+   return NULL;
+}
+
+// Every record goes out in a single write() so that a record is never
+// split by another process or by being killed halfway through.
+static bool journal_write (askme_journal_t *journal, const char *record, size_t len)
+{
+   while (len) {
+      ssize_t nbytes = write (journal->fd, record, len);
+      if (nbytes < 0) {
+         if (errno == EINTR)
+            continue;
+         ASKME_LOG ("Failed to write to [%s]: %m\n", journal->path);
+         return false;
+      }
+      record += nbytes;
+      len -= nbytes;
+   }
+
+   bool ret = true;
+   pthread_mutex_lock (&journal->lock);
+   if (journal->pending++ == 0) {
+      // The first record of a batch starts the clock for the flusher
+      clock_gettime (CLOCK_MONOTONIC, &journal->deadline);
+      journal->deadline.tv_sec += journal->sync_ms / 1000;
+      journal->deadline.tv_nsec += (journal->sync_ms % 1000) * 1000000;
+      if (journal->deadline.tv_nsec >= 1000000000) {
+         journal->deadline.tv_sec++;
+         journal->deadline.tv_nsec -= 1000000000;
+      }
+      pthread_cond_signal (&journal->wakeup);
+   }
+   if (journal->pending >= journal->sync_count || !journal->have_flusher) {
+      ret = journal_sync_locked (journal);
+   }
+   pthread_mutex_unlock (&journal->lock);
+   return ret;
+}
+
+askme_journal_t *askme_journal_create (const char *topic,
+                                       unsigned int seed,
+                                       size_t total_questions,
+                                       const size_t *order,
+                                       size_t nquestions)
+{
+   askme_journal_t *ret = NULL;
+   char *record = NULL;
+   size_t len = 0;
+   // Worst case is 20 digits and a tab per index.
+   size_t record_len = 64 + nquestions * 21;
+
+   if (!(ret = journal_open (topic, O_CREAT | O_EXCL, -1))) {
+      return NULL;
+   }
+
+   if (!(record = malloc (record_len))) {
+      ASKME_LOG ("OOM error - cannot allocate journal record of %zu bytes\n", record_len);
+      goto errorexit;
+   }
+
+   len = snprintf (record, record_len, "session\t%" PRIu64 "\t%u\t%zu\t%zu\n",
+                   (uint64_t)time (NULL), seed, total_questions, nquestions);
+   if (!(journal_write (ret, record, len))) {
+      goto errorexit;
+   }
+
+   len = snprintf (record, record_len, "order");
+   for (size_t i=0; i<nquestions; i++) {
+      len += snprintf (&record[len], record_len - len, "\t%zu", order[i]);
+   }
+   len += snprintf (&record[len], record_len - len, "\n");
+   if (!(journal_write (ret, record, len))) {
+      goto errorexit;
+   }
+
+   // The session is useless without its order, so don't wait for the batch.
+   if (!(askme_journal_sync (ret))) {
+      goto errorexit;
+   }
+
+   free (record);
+   return ret;
+
+errorexit:
+   free (record);
+   askme_journal_close (ret, false);
+   return NULL;
+}
+
+askme_journal_t *askme_journal_open (const char *topic,
+                                     const askme_session_t *session)
+{
+   return journal_open (topic, 0, session->journal_len);
+}
+
+bool askme_journal_exists (const char *topic)
+{
+   struct stat sb;
+   char *path = askme_get_subdir ("sessions/", topic, NULL);
+   bool ret = path && (stat (path, &sb))==0;
+   free (path);
+   return ret;
+}
+
+bool askme_journal_discard (const char *topic)
+{
+   bool ret = true;
+   char *path = NULL;
+
+   if (!(path = askme_get_subdir ("sessions/", topic, NULL))) {
+      ASKME_LOG ("OOM error - unable to create pathname [sessions/%s]\n", topic);
+      return false;
+   }
+   if ((unlink (path))!=0 && errno != ENOENT) {
+      ASKME_LOG ("Failed to remove [%s]: %m\n", path);
+      ret = false;
+   }
+   free (path);
+   return ret;
+}
+
+bool askme_journal_sample (askme_journal_t *journal,
+                           char **topics, size_t ntopics,
+                           const size_t *topic, const size_t *record,
+                           size_t total_questions)
+{
+   bool error = true;
+   char *line = NULL;
+   size_t len = 0;
+   // Worst case is two 20-digit numbers, a colon and a tab per question.
+   size_t line_len = 16 + total_questions * 42;
+
+   if (!(line = ds_str_dup ("topics"))) {
+      ASKME_LOG ("OOM error - cannot allocate journal record\n");
+      goto errorexit;
+   }
+   for (size_t i=0; i<ntopics; i++) {
+      if (!(ds_str_append (&line, "\t", topics[i], NULL))) {
+         ASKME_LOG ("OOM error - cannot allocate journal record\n");
+         goto errorexit;
+      }
+   }
+   if (!(ds_str_append (&line, "\n", NULL))
+         || !(journal_write (journal, line, strlen (line)))) {
+      goto errorexit;
+   }
+
+   free (line);
+   if (!(line = malloc (line_len))) {
+      ASKME_LOG ("OOM error - cannot allocate journal record of %zu bytes\n", line_len);
+      goto errorexit;
+   }
+
+   len = snprintf (line, line_len, "sample");
+   for (size_t i=0; i<total_questions; i++) {
+      len += snprintf (&line[len], line_len - len, "\t%zu:%zu", topic[i], record[i]);
+   }
+   len += snprintf (&line[len], line_len - len, "\n");
+   if (!(journal_write (journal, line, len))) {
+      goto errorexit;
+   }
+
+   // As with the order, the session cannot be resumed without this.
+   error = !askme_journal_sync (journal);
+
+errorexit:
+   free (line);
+   return !error;
+}
+
+bool askme_journal_response (askme_journal_t *journal, size_t position,
+                             uint64_t response)
+{
+   char record[64];
+   int len = snprintf (record, sizeof record, "response\t%zu\t%" PRIu64 "\n",
+                       position, response);
+   return journal_write (journal, record, len);
+}
+
+bool askme_journal_sync (askme_journal_t *journal)
+{
+   pthread_mutex_lock (&journal->lock);
+   bool ret = journal_sync_locked (journal);
+   pthread_mutex_unlock (&journal->lock);
+   return ret;
+}
+
+void askme_journal_close (askme_journal_t *journal, bool completed)
+{
+   if (!journal)
+      return;
+
+   if (journal->have_flusher) {
+      pthread_mutex_lock (&journal->lock);
+      journal->stopping = true;
+      pthread_cond_signal (&journal->wakeup);
+      pthread_mutex_unlock (&journal->lock);
+      pthread_join (journal->flusher, NULL);
+   }
+
+   if (journal->fd >= 0) {
+      if (!completed)
+         askme_journal_sync (journal);
+      close (journal->fd);
+   }
+
+   if (completed && journal->path && (unlink (journal->path))!=0) {
+      ASKME_LOG ("Warning: failed to remove [%s]: %m\n", journal->path);
+   }
+
+   pthread_cond_destroy (&journal->wakeup);
+   pthread_mutex_destroy (&journal->lock);
+   free (journal->path);
+   free (journal);
+}
+
+static bool parse_topics (char *fields, askme_session_t *session)
+{
+   char *saveptr = NULL;
+
+   for (char *field = strtok_r (fields, "\t", &saveptr);
+        field;
+        field = strtok_r (NULL, "\t", &saveptr)) {
+      char **tmp = realloc (session->topics, (session->ntopics + 1) * sizeof *tmp);
+      if (!tmp)
+         return false;
+      session->topics = tmp;
+      if (!(session->topics[session->ntopics] = ds_str_dup (field)))
+         return false;
+      session->ntopics++;
+   }
+   return session->ntopics > 0;
+}
+
+static bool parse_sample (char *fields, askme_session_t *session)
+{
+   char *saveptr = NULL;
+   char *field = NULL;
+   size_t i = 0;
+
+   if (!session->ntopics || session->sample_topic)
+      return false;
+
+   if (!(session->sample_topic = calloc (session->total_questions + 1,
+                                         sizeof *session->sample_topic))
+         || !(session->sample_record = calloc (session->total_questions + 1,
+                                               sizeof *session->sample_record))) {
+      return false;
+   }
+
+   for (field = strtok_r (fields, "\t", &saveptr);
+        field && i < session->total_questions;
+        field = strtok_r (NULL, "\t", &saveptr)) {
+      if ((sscanf (field, "%zu:%zu", &session->sample_topic[i],
+                                      &session->sample_record[i]))!=2
+            || session->sample_topic[i] >= session->ntopics) {
+         return false;
+      }
+      i++;
+   }
+   return i == session->total_questions && !field;
+}
+
+static bool parse_order (char *fields, askme_session_t *session)
+{
+   char *saveptr = NULL;
+   char *field = NULL;
+   size_t i = 0;
+
+   for (field = strtok_r (fields, "\t", &saveptr);
+        field && i < session->nquestions;
+        field = strtok_r (NULL, "\t", &saveptr)) {
+      if ((sscanf (field, "%zu", &session->order[i]))!=1
+            || session->order[i] >= session->total_questions) {
+         return false;
+      }
+      i++;
+   }
+   return i == session->nquestions;
+}
+
+bool askme_journal_load (const char *topic, askme_session_t *session)
+{
+   bool error = true;
+   char *path = NULL;
+   FILE *inf = NULL;
+   char *line = NULL;
+   size_t line_len = 0;
+   ssize_t nbytes = 0;
+   size_t linenum = 0;
+   bool have_order = false;
+
+   memset (session, 0, sizeof *session);
+
+   if (!(path = askme_get_subdir ("sessions/", topic, NULL))) {
+      ASKME_LOG ("OOM error - unable to create pathname [sessions/%s]\n", topic);
+      goto errorexit;
+   }
+
+   if (!(inf = fopen (path, "rt"))) {
+      ASKME_LOG ("Failed to open [%s]: %m\n", path);
+      goto errorexit;
+   }
+
+   while ((nbytes = getline (&line, &line_len, inf)) > 0) {
+      linenum++;
+
+      // A record without its newline was cut short, and as records only
+      // ever go on the end, it is the last one.
+      if (line[nbytes - 1] != '\n') {
+         ASKME_LOG ("[%s:%zu] Dropping a partial record\n", path, linenum);
+         break;
+      }
+      line[nbytes - 1] = 0;
+      session->journal_len += nbytes;
+
+      if (linenum == 1) {
+         uint64_t epoch;
+         if ((sscanf (line, "session\t%" SCNu64 "\t%u\t%zu\t%zu", &epoch,
+                      &session->seed,
+                      &session->total_questions,
+                      &session->nquestions))!=4) {
+            ASKME_LOG ("[%s:%zu] Not a session journal\n", path, linenum);
+            goto errorexit;
+         }
+         if (session->nquestions > session->total_questions) {
+            ASKME_LOG ("[%s:%zu] Corrupt session record\n", path, linenum);
+            goto errorexit;
+         }
+         if (!(session->order = calloc (session->nquestions + 1, sizeof *session->order))
+               || !(session->responses = calloc (session->nquestions + 1,
+                                                 sizeof *session->responses))) {
+            ASKME_LOG ("OOM error - cannot allocate session of %zu questions\n",
+                       session->nquestions);
+            goto errorexit;
+         }
+         continue;
+      }
+
+      if ((memcmp (line, "order\t", 6))==0 || (strcmp (line, "order"))==0) {
+         if (!(parse_order (&line[5], session))) {
+            ASKME_LOG ("[%s:%zu] Corrupt order record\n", path, linenum);
+            goto errorexit;
+         }
+         have_order = true;
+         continue;
+      }
+
+      if ((memcmp (line, "topics\t", 7))==0) {
+         if (session->ntopics || !(parse_topics (&line[7], session))) {
+            ASKME_LOG ("[%s:%zu] Corrupt topics record\n", path, linenum);
+            goto errorexit;
+         }
+         continue;
+      }
+
+      if ((memcmp (line, "sample\t", 7))==0 || (strcmp (line, "sample"))==0) {
+         if (!(parse_sample (&line[6], session))) {
+            ASKME_LOG ("[%s:%zu] Corrupt sample record\n", path, linenum);
+            goto errorexit;
+         }
+         continue;
+      }
+
+      size_t position;
+      uint64_t response;
+      if ((sscanf (line, "response\t%zu\t%" SCNu64, &position, &response))==2) {
+         if (position != session->nanswered || position >= session->nquestions) {
+            ASKME_LOG ("[%s:%zu] Response out of sequence\n", path, linenum);
+            goto errorexit;
+         }
+         session->responses[position] = response;
+         session->nanswered++;
+         continue;
+      }
+
+      ASKME_LOG ("[%s:%zu] Unrecognised record, ignoring\n", path, linenum);
+   }
+
+   if (!have_order) {
+      ASKME_LOG ("[%s] Journal has no question order\n", path);
+      goto errorexit;
+   }
+
+   if (session->ntopics && !session->sample_topic) {
+      ASKME_LOG ("[%s] Journal has topics but no sample\n", path);
+      goto errorexit;
+   }
+
+   error = false;
+
+errorexit:
+   free (line);
+   free (path);
+   if (inf)
+      fclose (inf);
+
+   if (error) {
+      askme_session_free (session);
+   }
+
+   return !error;
+}
+
+void askme_session_free (askme_session_t *session)
+{
+   free (session->order);
+   free (session->responses);
+   for (size_t i=0; i<session->ntopics; i++) {
+      free (session->topics[i]);
+   }
+   free (session->topics);
+   free (session->sample_topic);
+   free (session->sample_record);
+   memset (session, 0, sizeof *session);
+}
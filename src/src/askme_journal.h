@@ -0,0 +1,100 @@
+#ifndef H_ASKME_JOURNAL
+#define H_ASKME_JOURNAL
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* An append-only journal of the session in progress for a topic, stored
+ * in ~/.askme/sessions/<topic>. Each record is a single tab-separated
+ * line that reaches the kernel in a single write(), so killing the
+ * process loses nothing. The journal is fdatasync()ed once every
+ * 'journal-sync-count' records (default 16), and a background thread
+ * syncs any records that have been waiting for 'journal-sync-ms'
+ * milliseconds (default 1000), so no record is left unsynced for longer
+ * than that however long the next answer takes. A count of 1 or a time
+ * of 0 syncs every record as it is written.
+ *
+ * Records:
+ *    session  <epoch> <seed> <total-questions> <nquestions>
+ *    order    <question-index> ... (nquestions of them)
+ *    topics   <topic> ... (sampled sessions only)
+ *    sample   <topic-number>:<record> ... (total-questions of them)
+ *    response <position> <response-bitmap>
+ *
+ * A sampled session records which record of which topic each question
+ * was drawn from, so that resuming it asks the same questions whatever
+ * the specification or the grades are by then.
+ *
+ * A record cut short by a crash is dropped when the journal is loaded,
+ * and cut off the file when it is reopened, so that the next record
+ * starts on a line of its own.
+ */
+
+typedef struct askme_journal_t askme_journal_t;
+
+typedef struct askme_session_t askme_session_t;
+struct askme_session_t {
+   unsigned int seed;
+   size_t total_questions;
+   size_t nquestions;
+   size_t *order;          // [nquestions] Question index for each position
+   uint64_t *responses;    // [nquestions] Response for each position
+   size_t nanswered;       // Positions [0 .. nanswered) have a response
+   uint64_t journal_len;   // Length of the journal up to its last whole record
+
+   // Only for sampled sessions; ntopics is 0 otherwise.
+   size_t ntopics;
+   char **topics;          // [ntopics]
+   size_t *sample_topic;   // [total_questions] Topic of each question
+   size_t *sample_record;  // [total_questions] Record number in that topic
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Starts a new journal for the topic. Fails if the topic already has
+   // one, so that an interrupted session is never lost by accident.
+   askme_journal_t *askme_journal_create (const char *topic,
+                                          unsigned int seed,
+                                          size_t total_questions,
+                                          const size_t *order,
+                                          size_t nquestions);
+
+   // Opens an existing journal for the topic so that a resumed session
+   // can continue appending to it. The journal is first cut back to
+   // session->journal_len, as read by askme_journal_load().
+   askme_journal_t *askme_journal_open (const char *topic,
+                                        const askme_session_t *session);
+
+   // Whether the topic has the journal of an interrupted session.
+   bool askme_journal_exists (const char *topic);
+   bool askme_journal_discard (const char *topic);
+
+   // Records where each question of a sampled session came from. Must
+   // be called before any response is journalled.
+   bool askme_journal_sample (askme_journal_t *journal,
+                              char **topics, size_t ntopics,
+                              const size_t *topic, const size_t *record,
+                              size_t total_questions);
+
+   bool askme_journal_response (askme_journal_t *journal, size_t position,
+                                uint64_t response);
+   bool askme_journal_sync (askme_journal_t *journal);
+
+   // Syncs and closes the journal. A completed session has its journal
+   // removed as there is nothing left to resume.
+   void askme_journal_close (askme_journal_t *journal, bool completed);
+
+   // Reads the journal for the topic back into a session. Returns false
+   // if there is no journal or it cannot be read.
+   bool askme_journal_load (const char *topic, askme_session_t *session);
+   void askme_session_free (askme_session_t *session);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
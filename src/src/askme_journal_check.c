@@ -0,0 +1,239 @@
+
+#define _POSIX_C_SOURCE    200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "askme_lib.h"
+#include "askme_journal.h"
+
+#include "ds_str.h"
+
+/* Crash recovery check for the session journal. A session is journalled,
+ * its last record is torn the way a crash in the middle of a write
+ * leaves it, and the session is then resumed twice, answering a question
+ * each time. Both resumes must read back every whole response and
+ * nothing of the torn one.
+ *
+ * Like askme_grade_stress, the check runs in a private home directory
+ * made with mkdtemp() so that it can never touch a real session.
+ */
+
+#define TOPIC                 ".journal-check"
+#define NQUESTIONS            (5)
+#define HOME_TEMPLATE         "/askme-journal-check-XXXXXX"
+#define TORN_RECORD           "response\t2\t12"
+
+// Makes an empty directory under $TMPDIR (or /tmp) to use as $HOME.
+static char *make_private_home (void)
+{
+   const char *tmpdir = getenv ("TMPDIR");
+   char *ret = ds_str_cat (tmpdir && tmpdir[0] ? tmpdir : "/tmp", HOME_TEMPLATE, NULL);
+
+   if (!ret) {
+      ASKME_LOG ("OOM error - unable to create pathname for the test directory\n");
+      return NULL;
+   }
+   if (!(mkdtemp (ret))) {
+      ASKME_LOG ("Failed to create [%s]: %m\n", ret);
+      free (ret);
+      return NULL;
+   }
+   return ret;
+}
+
+static void remove_tree (const char *path)
+{
+   DIR *dir = opendir (path);
+   struct dirent *de;
+
+   while (dir && (de = readdir (dir))) {
+      if ((strcmp (de->d_name, "."))==0 || (strcmp (de->d_name, ".."))==0)
+         continue;
+
+      char *child = ds_str_cat (path, "/", de->d_name, NULL);
+      struct stat sb;
+      if (child && (lstat (child, &sb))==0) {
+         if (S_ISDIR (sb.st_mode)) {
+            remove_tree (child);
+         } else if ((unlink (child))!=0) {
+            ASKME_LOG ("Failed to remove [%s]: %m\n", child);
+         }
+      }
+      free (child);
+   }
+   if (dir)
+      closedir (dir);
+
+   if ((rmdir (path))!=0) {
+      ASKME_LOG ("Failed to remove [%s]: %m\n", path);
+   }
+}
+
+// Appends the start of a record without its newline, as a process
+// killed halfway through writing it would.
+static bool tear_journal (const char *path)
+{
+   int fd = open (path, O_WRONLY | O_APPEND);
+   if (fd < 0) {
+      ASKME_LOG ("Failed to open [%s]: %m\n", path);
+      return false;
+   }
+   bool ret = (write (fd, TORN_RECORD, strlen (TORN_RECORD))) == (ssize_t)strlen (TORN_RECORD);
+   if (!ret) {
+      ASKME_LOG ("Failed to write to [%s]: %m\n", path);
+   }
+   close (fd);
+   return ret;
+}
+
+// Loads the session and checks that it holds exactly the first
+// nanswered responses. Returns the number of problems.
+static size_t check_session (const char *step, askme_session_t *session, size_t nanswered)
+{
+   size_t problems = 0;
+
+   if (!(askme_journal_load (TOPIC, session))) {
+      printf ("%s: the journal cannot be loaded\n", step);
+      return 1;
+   }
+   if (session->nanswered != nanswered) {
+      printf ("%s: %zu responses read back, expected %zu\n",
+              step, session->nanswered, nanswered);
+      problems++;
+   }
+   for (size_t i=0; i<session->nanswered && i<nanswered; i++) {
+      if (session->responses[i] != (uint64_t)1 << (i + 1)) {
+         printf ("%s: response %zu is %" PRIu64 "\n", step, i, session->responses[i]);
+         problems++;
+      }
+   }
+   printf ("%s: %zu responses, %s\n", step, session->nanswered, problems ? "FAILED" : "ok");
+   return problems;
+}
+
+// Resumes the session and answers the next question.
+static size_t resume_and_answer (const char *step, size_t nanswered)
+{
+   size_t problems = 0;
+   askme_session_t session;
+   askme_journal_t *journal = NULL;
+
+   if ((problems = check_session (step, &session, nanswered))) {
+      askme_session_free (&session);
+      return problems;
+   }
+
+   if (!(journal = askme_journal_open (TOPIC, &session))
+         || !(askme_journal_response (journal, nanswered, (uint64_t)1 << (nanswered + 1)))) {
+      printf ("%s: the session cannot be continued\n", step);
+      problems++;
+   }
+   askme_journal_close (journal, false);
+   askme_session_free (&session);
+   return problems;
+}
+
+static const char *help_msg[] = {
+"askme_journal_check: Session journal crash recovery check",
+"  --help            This message",
+"  --keep            Keep the test directory and journal afterwards",
+"",
+"  A journal is written, its last record is torn as a crash would leave",
+"it and the session is resumed twice. Every whole response must be read",
+"back each time, and a new session must not replace the journal.",
+"",
+"  The check runs with $HOME set to a new directory in $TMPDIR (or /tmp),",
+"so the sessions in the real $HOME are never touched.",
+NULL,
+};
+
+int main (int argc, char **argv)
+{
+   int ret = EXIT_FAILURE;
+   char *home = NULL;
+   char *path = NULL;
+   askme_journal_t *journal = NULL;
+   askme_session_t session;
+   size_t order[NQUESTIONS];
+   size_t problems = 0;
+
+   askme_read_cline (argc, argv);
+
+   if (getenv ("help")) {
+      for (size_t i=0; help_msg[i]; i++) {
+         printf ("%s\n", help_msg[i]);
+      }
+      return EXIT_SUCCESS;
+   }
+
+   if (!(home = make_private_home ())
+         || (setenv ("HOME", home, 1))!=0) {
+      goto errorexit;
+   }
+
+   if (!(path = askme_get_subdir ("sessions/", TOPIC, NULL))) {
+      ASKME_LOG ("OOM error - unable to create pathname [sessions/%s]\n", TOPIC);
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<NQUESTIONS; i++) {
+      order[i] = NQUESTIONS - 1 - i;
+   }
+
+   // Two answers, then a crash while writing the third
+   if (!(journal = askme_journal_create (TOPIC, 9, NQUESTIONS, order, NQUESTIONS))
+         || !(askme_journal_response (journal, 0, 1 << 1))
+         || !(askme_journal_response (journal, 1, 1 << 2))) {
+      goto errorexit;
+   }
+   askme_journal_close (journal, false);
+   journal = NULL;
+
+   if (!(tear_journal (path))) {
+      goto errorexit;
+   }
+
+   problems += resume_and_answer ("First resume", 2);
+   problems += resume_and_answer ("Second resume", 3);
+   problems += check_session ("After both resumes", &session, 4);
+   askme_session_free (&session);
+
+   // Starting again must leave the interrupted session alone
+   if ((journal = askme_journal_create (TOPIC, 9, NQUESTIONS, order, NQUESTIONS))) {
+      printf ("A new session replaced the interrupted one\n");
+      askme_journal_close (journal, false);
+      journal = NULL;
+      problems++;
+   }
+   problems += check_session ("After a new session was refused", &session, 4);
+   askme_session_free (&session);
+
+   printf ("%zu problems found\n", problems);
+   if (!problems) {
+      ret = EXIT_SUCCESS;
+   }
+
+errorexit:
+   askme_journal_close (journal, false);
+
+   if (home && getenv ("keep")) {
+      printf ("Kept [%s]\n", home);
+   } else if (home) {
+      remove_tree (home);
+   }
+   free (path);
+   free (home);
+
+   return ret;
+}
+
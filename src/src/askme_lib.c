@@ -1,13 +1,15 @@
 
-#define _POSIX_C_SOURCE    200112L
+#define _POSIX_C_SOURCE    200809L
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <time.h>
 #include <inttypes.h>
+#include <errno.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
 
@@ -16,6 +18,13 @@
 #include "ds_str.h"
 #include "ds_array.h"
 
+// Waiting for the grade file lock gives up after about a second.
+#define GRADE_LOCK_ATTEMPTS      (1000)
+#define GRADE_LOCK_WAIT_NS       (1000000)
+
+// askme_hash_file() reads this much at a time.
+#define HASH_READ_SIZE           (1024 * 1024)
+
 void askme_read_cline (int argc, char **argv)
 {
    (void)argc;
@@ -67,6 +76,11 @@ static void create_homedir ()
    create_dir (homedir, NULL);
    create_dir (homedir, "/topics", NULL);
    create_dir (homedir, "/grades", NULL);
+   create_dir (homedir, "/sessions", NULL);
+   create_dir (homedir, "/index", NULL);
+   create_dir (homedir, "/validated", NULL);
+   create_dir (homedir, "/history", NULL);
+   create_dir (homedir, "/cache", NULL);
    free (homedir);
 }
 
@@ -216,6 +230,20 @@ errorexit:
    return ret;
 }
 
+bool askme_line_length (size_t *line_len)
+{
+   // TODO: Implement unit suffixes (MB, KB, etc)
+   if (getenv ("line-length")) {
+      if ((sscanf (getenv ("line-length"), "%zu", line_len))!=1) {
+         ASKME_LOG ("Failed to read [%s] as a line-length.\n", getenv ("line-length"));
+         return false;
+      }
+   } else {
+      *line_len = 1024 * 1024 * 8; // 8MB ought to be enough as a default
+   }
+   return true;
+}
+
 char ***askme_parse_qfile (FILE *inf)
 {
    bool error = true;
@@ -224,14 +252,8 @@ char ***askme_parse_qfile (FILE *inf)
    void **array = NULL;
    size_t line_len = 0;
 
-   // TODO: Implement unit suffixes (MB, KB, etc)
-   if (getenv ("line-length")) {
-      if ((sscanf (getenv ("line-length"), "%zu", &line_len))!=1) {
-         ASKME_LOG ("Failed to read [%s] as a line-length.\n", getenv ("line-length"));
-         goto errorexit;
-      }
-   } else {
-      line_len = 1024 * 1024 * 8; // 8MB ought to be enough as a default
+   if (!(askme_line_length (&line_len))) {
+      goto errorexit;
    }
 
    if (!(array = ds_array_new ())) {
@@ -355,30 +377,213 @@ size_t askme_count_questions (char ***questions)
    return ret;
 }
 
-static size_t reversebits (size_t n)
+// Decodes the answer template without checking it; used for topics
+// that have already been validated. Option n (counting from 1) is bit n
+// of the result. The template must be no wider than ASKME_MAX_OPTIONS.
+static size_t decode_answer (const char *answer_string)
 {
    size_t ret = 0;
-   for (int i=sizeof (size_t); i>=0; i--) {
-      if ((n >> i) & 1) {
-         ret |= 1;
-      }
-      ret = ret << 1;
+   for (size_t i=0; answer_string[i]; i++) {
+      if (answer_string[i] == '1')     ASKME_SETBIT (ret, i + 1);
    }
    return ret;
 }
 
 size_t askme_parse_answer (const char *answer_string)
 {
-   size_t ret = 0;
-   for (size_t i=0; answer_string && answer_string[i]; i++) {
-      if (answer_string[i] == '1')     ret |= (1 << i);
-      if (answer_string[i] == '0')     ret = ret;  // Do nothing
+   if (!answer_string)
+      return 0;
+
+   if (strlen (answer_string) > ASKME_MAX_OPTIONS) {
+      ASKME_LOG ("Error: answer template [%s] is wider than the %i supported options\n",
+                 answer_string, ASKME_MAX_OPTIONS);
+      return 0;
+   }
+
+   for (size_t i=0; answer_string[i]; i++) {
       if (answer_string[i]!='0' && answer_string[i]!='1') {
          ASKME_LOG ("Warning: answer template [%s] contains a '%c'. Only zeros and ones are allowed\n",
                     answer_string, answer_string[i]);
       }
    }
-   return reversebits (ret);
+   return decode_answer (answer_string);
+}
+
+/* The hash is four independent xxHash64-style lanes over 32-byte
+ * blocks, so it runs at close to memory speed. Bytes that do not yet
+ * make up a whole block wait in the state, which lets a hash of a file
+ * be saved and later extended over whatever was appended to it.
+ */
+#define HASH_PRIME1        UINT64_C(0x9E3779B185EBCA87)
+#define HASH_PRIME2        UINT64_C(0xC2B2AE3D27D4EB4F)
+
+static uint64_t hash_round (uint64_t lane, uint64_t word)
+{
+   lane += word * HASH_PRIME2;
+   lane = (lane << 31) | (lane >> 33);
+   return lane * HASH_PRIME1;
+}
+
+static void hash_block (askme_hash_t *hash, const unsigned char *block)
+{
+   for (size_t i=0; i<4; i++) {
+      uint64_t word;
+      memcpy (&word, &block[i * 8], sizeof word);
+      hash->lanes[i] = hash_round (hash->lanes[i], word);
+   }
+}
+
+void askme_hash_init (askme_hash_t *hash)
+{
+   memset (hash, 0, sizeof *hash);
+   hash->lanes[0] = HASH_PRIME1 + HASH_PRIME2;
+   hash->lanes[1] = HASH_PRIME2;
+   hash->lanes[2] = 0;
+   hash->lanes[3] = -HASH_PRIME1;
+}
+
+void askme_hash_update (askme_hash_t *hash, const void *data, size_t len)
+{
+   const unsigned char *bytes = data;
+   size_t npending = hash->len % ASKME_HASH_BLOCK;
+
+   hash->len += len;
+
+   if (npending) {
+      size_t n = ASKME_HASH_BLOCK - npending;
+      if (n > len)
+         n = len;
+      memcpy (&hash->pending[npending], bytes, n);
+      bytes += n;
+      len -= n;
+      if (npending + n < ASKME_HASH_BLOCK)
+         return;
+      hash_block (hash, hash->pending);
+   }
+
+   for (; len >= ASKME_HASH_BLOCK; bytes += ASKME_HASH_BLOCK, len -= ASKME_HASH_BLOCK) {
+      hash_block (hash, bytes);
+   }
+   memcpy (hash->pending, bytes, len);
+}
+
+uint64_t askme_hash_final (const askme_hash_t *hash)
+{
+   uint64_t ret = hash->len;
+   for (size_t i=0; i<4; i++) {
+      ret = hash_round (ret ^ hash->lanes[i], HASH_PRIME1);
+   }
+   for (size_t i=0; i<hash->len % ASKME_HASH_BLOCK; i++) {
+      ret = (ret ^ hash->pending[i]) * HASH_PRIME1;
+   }
+   ret ^= ret >> 33;
+   ret *= HASH_PRIME2;
+   return ret ^ (ret >> 29);
+}
+
+bool askme_hash_file (askme_hash_t *hash, int fd, uint64_t offset, uint64_t len)
+{
+   unsigned char *buf = malloc (HASH_READ_SIZE);
+
+   if (!buf) {
+      ASKME_LOG ("OOM error - unable to allocate hash buffer\n");
+      return false;
+   }
+
+   while (len) {
+      size_t n = len < HASH_READ_SIZE ? len : HASH_READ_SIZE;
+      ssize_t nbytes = pread (fd, buf, n, offset);
+      if (nbytes <= 0) {
+         if (nbytes < 0 && errno == EINTR)
+            continue;
+         free (buf);
+         return false;
+      }
+      askme_hash_update (hash, buf, nbytes);
+      offset += nbytes;
+      len -= nbytes;
+   }
+
+   free (buf);
+   return true;
+}
+
+static bool topic_stat (const char *topic, struct stat *sb)
+{
+   char *fname = askme_get_subdir ("topics/", topic, NULL);
+   if (!fname)
+      return false;
+
+   int rc = stat (fname, sb);
+   free (fname);
+   return rc == 0;
+}
+
+bool askme_mark_validated (const char *topic, const struct stat *sb)
+{
+   bool ret = false;
+   char *fname = askme_get_subdir ("validated/", topic, NULL);
+   FILE *outf = NULL;
+
+   if (!fname) {
+      ASKME_LOG ("OOM error - unable to create pathname [validated/%s]\n", topic);
+      return false;
+   }
+
+   if (!sb) {
+      ret = (unlink (fname))==0 || errno == ENOENT;
+      goto errorexit;
+   }
+
+   if (!(outf = fopen (fname, "wt"))) {
+      ASKME_LOG ("Failed to open [%s]: %m\n", fname);
+      goto errorexit;
+   }
+
+   fprintf (outf, "%" PRIu64 "\t%" PRId64 "\t%ld\n",
+                  (uint64_t)sb->st_size,
+                  (int64_t)sb->st_mtim.tv_sec,
+                  (long)sb->st_mtim.tv_nsec);
+
+   ret = (fclose (outf))==0;
+   outf = NULL;
+
+errorexit:
+   if (outf)
+      fclose (outf);
+   free (fname);
+   return ret;
+}
+
+bool askme_is_validated (const char *topic)
+{
+   bool ret = false;
+   struct stat sb;
+   char *fname = askme_get_subdir ("validated/", topic, NULL);
+   FILE *inf = NULL;
+   uint64_t size;
+   int64_t sec;
+   long nsec;
+
+   if (!fname)
+      return false;
+
+   if (!(inf = fopen (fname, "rt"))
+         || (fscanf (inf, "%" SCNu64 "\t%" SCNd64 "\t%ld", &size, &sec, &nsec))!=3
+         || !(topic_stat (topic, &sb))) {
+      goto errorexit;
+   }
+
+   // Any change to the topic since it was validated voids the mark.
+   ret = size == (uint64_t)sb.st_size
+      && sec == (int64_t)sb.st_mtim.tv_sec
+      && nsec == (long)sb.st_mtim.tv_nsec;
+
+errorexit:
+   if (inf)
+      fclose (inf);
+   free (fname);
+   return ret;
 }
 
 bool askme_save_grade (const char *topic, size_t correct, size_t total)
@@ -396,7 +601,10 @@ bool askme_save_grade (const char *topic, size_t correct, size_t total)
    memset (fld_date_display, 0, sizeof fld_date_display);
 
    snprintf (fld_date_epoch, sizeof fld_date_epoch, "%" PRIu64, date_epoch);
-   strncpy (fld_date_display, ctime ((time_t *)&date_epoch), sizeof fld_date_display);
+   time_t now = date_epoch;
+   if (!(ctime_r (&now, fld_date_display))) {
+      fld_date_display[0] = 0;
+   }
    snprintf (fld_correct, sizeof fld_correct, "%zu", correct);
    snprintf (fld_total, sizeof fld_total, "%zu", total);
    snprintf (fld_perc, sizeof fld_perc, "%.0f", perc);
@@ -409,26 +617,726 @@ bool askme_save_grade (const char *topic, size_t correct, size_t total)
    if (nl)
       *nl = 0;
 
+   // The whole record goes out in one write() on an O_APPEND descriptor
+   // so that concurrent writers cannot interleave within a line.
+   char record[256];
+   int record_len = snprintf (record, sizeof record, "%s\t%s\t%s\t%s\t%s\n",
+                              fld_date_epoch,
+                              fld_date_display,
+                              fld_correct,
+                              fld_total,
+                              fld_perc);
+   if (record_len < 0 || (size_t)record_len >= sizeof record) {
+      ASKME_LOG ("Grade record for [%s] is too long\n", topic);
+      return false;
+   }
+
    char *fname = askme_get_subdir ("grades/", topic, NULL);
    if (!fname)
       return false;
 
-   FILE *outf = fopen (fname, "at");
-   if (!outf) {
-      free (fname);
+   int fd = open (fname, O_WRONLY | O_APPEND | O_CREAT, 0644);
+   if (fd < 0) {
       ASKME_LOG ("Failed to open [%s]: %m\n", fname);
+      free (fname);
       return false;
    }
 
-   fprintf (outf, "%s\t%s\t%s\t%s\t%s\n",
-                  fld_date_epoch,
-                  fld_date_display,
-                  fld_correct,
-                  fld_total,
-                  fld_perc);
+   // O_APPEND is not atomic on NFS, so hold a write lock across the
+   // write. The wait for the lock is bounded; if it cannot be had the
+   // record is still written with a single O_APPEND write.
+   struct flock fl;
+   memset (&fl, 0, sizeof fl);
+   fl.l_type = F_WRLCK;
+   fl.l_whence = SEEK_SET;
+
+   bool locked = false;
+   for (int i=0; i<GRADE_LOCK_ATTEMPTS && !locked; i++) {
+      if ((fcntl (fd, F_SETLK, &fl))==0) {
+         locked = true;
+      } else if (errno == EACCES || errno == EAGAIN || errno == EINTR) {
+         struct timespec ts = { 0, GRADE_LOCK_WAIT_NS };
+         nanosleep (&ts, NULL);
+      } else {
+         // Locking is unsupported on this filesystem.
+         break;
+      }
+   }
+
+   bool ret = true;
+   ssize_t nbytes;
+   while ((nbytes = write (fd, record, record_len)) < 0 && errno == EINTR)
+      ;
+   if (nbytes != record_len) {
+      ASKME_LOG ("Failed to write grade to [%s]: %m\n", fname);
+      ret = false;
+   }
+
+   if (locked) {
+      fl.l_type = F_UNLCK;
+      fcntl (fd, F_SETLK, &fl);
+   }
+
+   if ((close (fd))!=0) {
+      ASKME_LOG ("Failed to close [%s]: %m\n", fname);
+      ret = false;
+   }
 
    free (fname);
-   fclose (outf);
 
+   return ret;
+}
+
+bool askme_recent_grade (const char *topic, size_t nrecent, double *average)
+{
+   bool error = true;
+   char *fname = NULL;
+   FILE *inf = NULL;
+   char line[512];
+   double *recent = NULL;
+   size_t nread = 0;
+
+   if (!nrecent)
+      return false;
+
+   if (!(fname = askme_get_subdir ("grades/", topic, NULL))) {
+      ASKME_LOG ("OOM error - unable to create pathname [grades/%s]\n", topic);
+      goto errorexit;
+   }
+
+   // No grades is not an error, there is simply nothing to average.
+   if (!(inf = fopen (fname, "rt"))) {
+      goto errorexit;
+   }
+
+   if (!(recent = calloc (nrecent, sizeof *recent))) {
+      ASKME_LOG ("OOM error - cannot allocate %zu grades\n", nrecent);
+      goto errorexit;
+   }
+
+   // Keep the last nrecent percentages in a ring.
+   while (fgets (line, sizeof line, inf)) {
+      char *perc = strrchr (line, '\t');
+      double value;
+      if (!perc || (sscanf (perc + 1, "%lf", &value))!=1)
+         continue;
+      recent[nread++ % nrecent] = value;
+   }
+
+   if (!nread)
+      goto errorexit;
+
+   size_t n = nread < nrecent ? nread : nrecent;
+   double total = 0.0;
+   for (size_t i=0; i<n; i++) {
+      total += recent[i];
+   }
+   *average = total / n;
+
+   error = false;
+
+errorexit:
+   if (inf)
+      fclose (inf);
+   free (recent);
+   free (fname);
+   return !error;
+}
+
+/* ******************************************************************** */
+
+static size_t grow_capacity (size_t cap, size_t needed)
+{
+   size_t ret = cap ? cap : 64;
+   while (ret < needed) {
+      ret *= 2;
+   }
+   return ret;
+}
+
+static bool qtable_reserve_text (askme_qtable_t *qt, size_t needed)
+{
+   if (needed <= qt->text_cap)
+      return true;
+
+   size_t newcap = grow_capacity (qt->text_cap, needed);
+   char *tmp = realloc (qt->text, newcap);
+   if (!tmp)
+      return false;
+
+   qt->text = tmp;
+   qt->text_cap = newcap;
+   return true;
+}
+
+static bool qtable_reserve_options (askme_qtable_t *qt, size_t needed)
+{
+   if (needed <= qt->options_cap)
+      return true;
+
+   size_t newcap = grow_capacity (qt->options_cap, needed);
+   size_t *tmp = realloc (qt->option_offs, newcap * sizeof *tmp);
+   if (!tmp)
+      return false;
+
+   qt->option_offs = tmp;
+   qt->options_cap = newcap;
+   return true;
+}
+
+// All the per-question arrays share a single capacity.
+static bool qtable_reserve_questions (askme_qtable_t *qt, size_t needed)
+{
+   if (needed <= qt->questions_cap)
+      return true;
+
+   size_t newcap = grow_capacity (qt->questions_cap, needed);
+   size_t **arrays[] = {
+      &qt->question_offs, &qt->answer, &qt->noptions, &qt->option_start,
+   };
+
+   for (size_t i=0; i<sizeof arrays / sizeof arrays[0]; i++) {
+      size_t *tmp = realloc (*arrays[i], newcap * sizeof *tmp);
+      if (!tmp)
+         return false;
+      *arrays[i] = tmp;
+   }
+
+   qt->questions_cap = newcap;
+   return true;
+}
+
+static bool qtable_add_text (askme_qtable_t *qt, const char *src, size_t *offs)
+{
+   size_t len = strlen (src) + 1;
+
+   if (!(qtable_reserve_text (qt, qt->text_len + len)))
+      return false;
+
+   memcpy (&qt->text[qt->text_len], src, len);
+   *offs = qt->text_len;
+   qt->text_len += len;
+   return true;
+}
+
+static void qtable_drop_view (askme_qtable_t *qt)
+{
+   free (qt->view_fields);
+   free (qt->view);
+   qt->view_fields = NULL;
+   qt->view = NULL;
+}
+
+askme_qtable_t *askme_qtable_new (void)
+{
+   askme_qtable_t *ret = calloc (1, sizeof *ret);
+   if (!ret) {
+      ASKME_LOG ("OOM error: allocating new question table\n");
+      return NULL;
+   }
+   askme_hash_init (&ret->hash);
+   return ret;
+}
+
+bool askme_qtable_append (askme_qtable_t *qt, char *line, size_t recordnum)
+{
+   char *saveptr = NULL;
+   char *question = strtok_r (line, "\t", &saveptr);
+   char *answer = NULL;
+   size_t index = qt->nquestions;
+   size_t offs = 0;
+
+   if (!question)
+      return true;
+
+   if (!(answer = strtok_r (NULL, "\t", &saveptr))) {
+      answer = "";
+   }
+
+   // An answer that cannot be represented must not be graded at all
+   size_t answer_width = strlen (answer);
+   if (answer_width > ASKME_MAX_OPTIONS) {
+      ASKME_LOG ("Error: record %zu has an answer template of width %zu, only %i "
+                 "options are supported\n",
+                 recordnum + 1, answer_width, ASKME_MAX_OPTIONS);
+      return false;
+   }
+
+   qtable_drop_view (qt);
+
+   if (!(qtable_reserve_questions (qt, index + 1))) {
+      ASKME_LOG ("OOM error - failed to add record %zu\n", recordnum);
+      return false;
+   }
+
+   if (!(qtable_add_text (qt, question, &qt->question_offs[index]))
+         || !(qtable_add_text (qt, answer, &offs))) {
+      ASKME_LOG ("OOM error - cannot allocate memory for record %zu\n", recordnum);
+      return false;
+   }
+
+   qt->answer[index] = qt->trusted ? decode_answer (answer) : askme_parse_answer (answer);
+   qt->noptions[index] = 0;
+   qt->option_start[index] = qt->noptions_total;
+
+   char *field = NULL;
+   while ((field = strtok_r (NULL, "\t", &saveptr))) {
+      size_t opt = qt->noptions_total;
+      if (!(qtable_reserve_options (qt, opt + 1))
+            || !(qtable_add_text (qt, field, &qt->option_offs[opt]))) {
+         ASKME_LOG ("OOM error - cannot allocate memory for record %zu, field %zu\n",
+                    recordnum, qt->noptions[index] + ASKME_QIDX_OPTION_OFFS);
+         return false;
+      }
+      qt->noptions[index]++;
+      qt->noptions_total++;
+   }
+
+   if (!qt->trusted) {
+      if (answer_width != qt->noptions[index]) {
+         ASKME_LOG ("Warning: record %zu has %zu options but an answer template of width %zu\n",
+                    recordnum + 1, qt->noptions[index], answer_width);
+      }
+      if (qt->noptions[index] > ASKME_MAX_OPTIONS) {
+         ASKME_LOG ("Warning: record %zu has %zu options, only %i are supported\n",
+                    recordnum + 1, qt->noptions[index], ASKME_MAX_OPTIONS);
+      }
+   }
+
+   qt->nquestions++;
    return true;
 }
+
+static bool qtable_read (askme_qtable_t *qt, FILE *inf)
+{
+   bool error = true;
+   char *line = NULL;
+   size_t line_len = 0;
+
+   if (!(askme_line_length (&line_len))) {
+      goto errorexit;
+   }
+
+   if (!(line = calloc (1, line_len))) {
+      ASKME_LOG ("OOM error allocating line of [%zu] bytes\n", line_len);
+      goto errorexit;
+   }
+
+   size_t recordnum = qt->nlines;
+   while (!feof (inf) && !ferror (inf) && fgets (line, line_len - 1, inf)) {
+      char *tmp = NULL;
+
+      // Ensure that we have the entire line
+      if (!(tmp = strchr (line, '\n'))) {
+         ASKME_LOG ("Line %zu exceeds the maximum line length of %zu. Try "
+                    "using the 'line-length' option to set a larger length"
+                    "\non lines in the input file.", recordnum, line_len);
+         goto errorexit;
+      }
+      askme_hash_update (&qt->hash, line, tmp - line + 1);
+      *tmp = 0;
+      if (!(askme_qtable_append (qt, line, recordnum))) {
+         goto errorexit;
+      }
+      recordnum++;
+   }
+
+   qt->nlines = recordnum;
+   error = false;
+
+errorexit:
+
+   free (line);
+
+   return !error;
+}
+
+/* The cache is a header followed by the arrays of the table exactly as
+ * they are in memory, so it is only usable on the machine that wrote it.
+ * It holds the hash of the part of the topic that was parsed. Unless the
+ * topic's size and modification time are exactly as they were when the
+ * cache was written, that part of the topic is hashed again to check it.
+ */
+#define CACHE_MAGIC        "ASKMEQC1"
+
+struct cache_header_t {
+   char magic[8];
+   askme_hash_t hash;
+   uint64_t topic_size;
+   int64_t topic_mtime_sec;
+   int64_t topic_mtime_nsec;
+   uint64_t nlines;
+   uint64_t nquestions;
+   uint64_t noptions_total;
+   uint64_t text_len;
+};
+
+static void qtable_clear (askme_qtable_t *qt)
+{
+   qtable_drop_view (qt);
+   qt->nquestions = 0;
+   qt->noptions_total = 0;
+   qt->text_len = 0;
+   qt->nlines = 0;
+   askme_hash_init (&qt->hash);
+}
+
+// Fills the empty table from the cache if the cache still matches the
+// start of the topic. On failure the table is left empty. unchanged is
+// set when the size and time in the cache are still those of the topic.
+static bool cache_load (askme_qtable_t *qt, const char *cachepath, int topic_fd,
+                        const struct stat *sb, bool *unchanged)
+{
+   bool error = true;
+   FILE *inf = NULL;
+   struct cache_header_t header;
+   askme_hash_t hash;
+
+   if (!(inf = fopen (cachepath, "rb"))) {
+      goto errorexit;
+   }
+
+   *unchanged = false;
+
+   struct stat cache_sb;
+   if ((fstat (fileno (inf), &cache_sb))!=0
+         || (fread (&header, sizeof header, 1, inf))!=1
+         || (memcmp (header.magic, CACHE_MAGIC, sizeof header.magic))!=0
+         || header.hash.len > (uint64_t)sb->st_size) {
+      goto errorexit;
+   }
+
+   // A damaged cache must not be trusted with the allocation sizes.
+   uint64_t cache_len = sizeof header + header.text_len
+                      + header.nquestions * 4 * sizeof (size_t)
+                      + header.noptions_total * sizeof (size_t);
+   if (header.text_len > (uint64_t)cache_sb.st_size
+         || header.nquestions > (uint64_t)cache_sb.st_size
+         || header.noptions_total > (uint64_t)cache_sb.st_size
+         || cache_len != (uint64_t)cache_sb.st_size) {
+      goto errorexit;
+   }
+
+   *unchanged = header.topic_size == (uint64_t)sb->st_size
+             && header.topic_mtime_sec == (int64_t)sb->st_mtim.tv_sec
+             && header.topic_mtime_nsec == (int64_t)sb->st_mtim.tv_nsec;
+
+   askme_hash_init (&hash);
+   if (!*unchanged
+         && (!(askme_hash_file (&hash, topic_fd, 0, header.hash.len))
+               || askme_hash_final (&hash) != askme_hash_final (&header.hash))) {
+      goto errorexit;
+   }
+
+   if (!(qtable_reserve_text (qt, header.text_len))
+         || !(qtable_reserve_questions (qt, header.nquestions))
+         || !(qtable_reserve_options (qt, header.noptions_total))) {
+      ASKME_LOG ("OOM error - cannot load %" PRIu64 " cached questions\n", header.nquestions);
+      goto errorexit;
+   }
+
+   size_t nq = header.nquestions;
+   if ((fread (qt->text, 1, header.text_len, inf))!=header.text_len
+         || (fread (qt->question_offs, sizeof *qt->question_offs, nq, inf))!=nq
+         || (fread (qt->answer, sizeof *qt->answer, nq, inf))!=nq
+         || (fread (qt->noptions, sizeof *qt->noptions, nq, inf))!=nq
+         || (fread (qt->option_start, sizeof *qt->option_start, nq, inf))!=nq
+         || (fread (qt->option_offs, sizeof *qt->option_offs, header.noptions_total, inf))
+               != header.noptions_total) {
+      goto errorexit;
+   }
+
+   qt->hash = header.hash;
+   qt->nlines = header.nlines;
+   qt->nquestions = header.nquestions;
+   qt->noptions_total = header.noptions_total;
+   qt->text_len = header.text_len;
+   error = false;
+
+errorexit:
+   if (inf)
+      fclose (inf);
+   if (error) {
+      qtable_clear (qt);
+      *unchanged = false;
+   }
+   return !error;
+}
+
+// The topic's time (or size) has changed without the part that was
+// cached changing, as after a touch: only the header needs rewriting to
+// bring back the shortcut past the hash. A reader that sees a mixture
+// of the old and new header fields just hashes the topic again, as the
+// rest of the header is the same.
+static bool cache_touch (const char *cachepath, const struct stat *sb)
+{
+   bool error = true;
+   int fd = -1;
+   struct cache_header_t header;
+
+   if ((fd = open (cachepath, O_RDWR)) < 0) {
+      ASKME_LOG ("Failed to open [%s]: %m\n", cachepath);
+      goto errorexit;
+   }
+
+   if ((pread (fd, &header, sizeof header, 0)) != (ssize_t)sizeof header) {
+      ASKME_LOG ("Failed to read [%s]: %m\n", cachepath);
+      goto errorexit;
+   }
+
+   header.topic_size = sb->st_size;
+   header.topic_mtime_sec = sb->st_mtim.tv_sec;
+   header.topic_mtime_nsec = sb->st_mtim.tv_nsec;
+   if ((pwrite (fd, &header, sizeof header, 0)) != (ssize_t)sizeof header) {
+      ASKME_LOG ("Failed to write [%s]: %m\n", cachepath);
+      goto errorexit;
+   }
+
+   error = false;
+
+errorexit:
+   if (fd >= 0)
+      close (fd);
+   return !error;
+}
+
+// Written to a temporary file which then replaces the cache, so that
+// readers only ever see a complete cache.
+static bool cache_save (const askme_qtable_t *qt, const char *cachepath,
+                        const struct stat *sb)
+{
+   bool error = true;
+   char *tmpname = NULL;
+   FILE *outf = NULL;
+   struct cache_header_t header;
+   size_t nq = qt->nquestions;
+
+   memset (&header, 0, sizeof header);
+   memcpy (header.magic, CACHE_MAGIC, sizeof header.magic);
+   header.hash = qt->hash;
+   header.topic_size = sb->st_size;
+   header.topic_mtime_sec = sb->st_mtim.tv_sec;
+   header.topic_mtime_nsec = sb->st_mtim.tv_nsec;
+   header.nlines = qt->nlines;
+   header.nquestions = qt->nquestions;
+   header.noptions_total = qt->noptions_total;
+   header.text_len = qt->text_len;
+
+   if (!(tmpname = ds_str_cat (cachepath, ".tmp", NULL))) {
+      ASKME_LOG ("OOM error - unable to create pathname [%s.tmp]\n", cachepath);
+      goto errorexit;
+   }
+
+   if (!(outf = fopen (tmpname, "wb"))) {
+      ASKME_LOG ("Failed to open [%s]: %m\n", tmpname);
+      goto errorexit;
+   }
+
+   if ((fwrite (&header, sizeof header, 1, outf))!=1
+         || (fwrite (qt->text, 1, qt->text_len, outf))!=qt->text_len
+         || (fwrite (qt->question_offs, sizeof *qt->question_offs, nq, outf))!=nq
+         || (fwrite (qt->answer, sizeof *qt->answer, nq, outf))!=nq
+         || (fwrite (qt->noptions, sizeof *qt->noptions, nq, outf))!=nq
+         || (fwrite (qt->option_start, sizeof *qt->option_start, nq, outf))!=nq
+         || (fwrite (qt->option_offs, sizeof *qt->option_offs, qt->noptions_total, outf))
+               != qt->noptions_total) {
+      ASKME_LOG ("Failed to write [%s]: %m\n", tmpname);
+      goto errorexit;
+   }
+
+   int rc = fclose (outf);
+   outf = NULL;
+   if (rc!=0) {
+      ASKME_LOG ("Failed to write [%s]: %m\n", tmpname);
+      goto errorexit;
+   }
+
+   if ((rename (tmpname, cachepath))!=0) {
+      ASKME_LOG ("Failed to rename [%s] to [%s]: %m\n", tmpname, cachepath);
+      goto errorexit;
+   }
+
+   error = false;
+
+errorexit:
+   if (outf)
+      fclose (outf);
+   if (error && tmpname)
+      unlink (tmpname);
+   free (tmpname);
+   return !error;
+}
+
+askme_qtable_t *askme_qtable_load (const char *topic)
+{
+   bool error = true;
+   char *fullpath = NULL;
+   char *cachepath = NULL;
+   askme_qtable_t *ret = NULL;
+   FILE *inf = NULL;
+   struct stat sb;
+
+   if (!(fullpath = askme_get_subdir ("topics/", topic, NULL))
+         || !(cachepath = askme_get_subdir ("cache/", topic, NULL))) {
+      ASKME_LOG ("OOM error - unable to create pathnames for [%s]\n", topic);
+      goto errorexit;
+   }
+
+   if (!(inf = fopen (fullpath, "rt"))) {
+      ASKME_LOG ("Failed to open [%s]: %m\n", fullpath);
+      goto errorexit;
+   }
+
+   if ((fstat (fileno (inf), &sb))!=0) {
+      ASKME_LOG ("Failed to stat [%s]: %m\n", fullpath);
+      goto errorexit;
+   }
+
+   if (!(ret = askme_qtable_new ())) {
+      goto errorexit;
+   }
+
+   // Topics that passed askme_lint are loaded without the field checks
+   ret->trusted = askme_is_validated (topic);
+
+   bool unchanged;
+   bool cached = cache_load (ret, cachepath, fileno (inf), &sb, &unchanged);
+   uint64_t cached_len = ret->hash.len;
+
+   if ((fseeko (inf, cached_len, SEEK_SET))!=0) {
+      ASKME_LOG ("Failed to seek in [%s]: %m\n", fullpath);
+      goto errorexit;
+   }
+
+   if (!(qtable_read (ret, inf))) {
+      ASKME_LOG ("Failed to parse [%s]: %m\n", fullpath);
+      goto errorexit;
+   }
+
+   // The size and time are only a shortcut past the hash when they
+   // describe exactly what was parsed.
+   if (ret->hash.len != (uint64_t)sb.st_size) {
+      sb.st_size = -1;
+   }
+
+   if (!cached || ret->hash.len != cached_len) {
+      if (!(cache_save (ret, cachepath, &sb))) {
+         ASKME_LOG ("Warning: failed to cache [%s]\n", topic);
+      }
+   } else if (!unchanged && !(cache_touch (cachepath, &sb))) {
+      ASKME_LOG ("Warning: failed to update the cache of [%s]\n", topic);
+   }
+
+   error = false;
+
+errorexit:
+   if (inf)
+      fclose (inf);
+
+   free (fullpath);
+   free (cachepath);
+
+   if (error) {
+      askme_qtable_del (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+askme_qtable_t *askme_qtable_parse (FILE *inf)
+{
+   askme_qtable_t *ret = askme_qtable_new ();
+
+   if (ret && !(qtable_read (ret, inf))) {
+      askme_qtable_del (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+void askme_qtable_del (askme_qtable_t *qt)
+{
+   if (!qt)
+      return;
+
+   qtable_drop_view (qt);
+   free (qt->text);
+   free (qt->question_offs);
+   free (qt->answer);
+   free (qt->noptions);
+   free (qt->option_start);
+   free (qt->option_offs);
+   free (qt);
+}
+
+size_t askme_qtable_count (const askme_qtable_t *qt)
+{
+   return qt ? qt->nquestions : 0;
+}
+
+const char *askme_qtable_question (const askme_qtable_t *qt, size_t index)
+{
+   return &qt->text[qt->question_offs[index]];
+}
+
+const char *askme_qtable_option (const askme_qtable_t *qt, size_t index, size_t option)
+{
+   return &qt->text[qt->option_offs[qt->option_start[index] + option]];
+}
+
+size_t *askme_qtable_order (const askme_qtable_t *qt)
+{
+   size_t *ret = calloc (qt->nquestions + 1, sizeof *ret);
+   if (!ret) {
+      ASKME_LOG ("OOM error - failed to allocate order of %zu elements\n", qt->nquestions);
+      return NULL;
+   }
+   for (size_t i=0; i<qt->nquestions; i++) {
+      ret[i] = i;
+   }
+   return ret;
+}
+
+void askme_randomise_order (size_t *order, size_t nitems, unsigned int seed)
+{
+   srand (seed);
+
+   for (size_t i=0; i<nitems; i++) {
+      size_t target = rand () % nitems;
+      size_t tmp = order[i];
+      order[i] = order[target];
+      order[target] = tmp;
+   }
+}
+
+char ***askme_qtable_view (askme_qtable_t *qt)
+{
+   if (qt->view)
+      return qt->view;
+
+   // Each record needs the question, the answer, the options and a NULL.
+   size_t nfields = qt->nquestions * 3 + qt->noptions_total;
+
+   if (!(qt->view_fields = calloc (nfields + 1, sizeof *qt->view_fields))
+         || !(qt->view = calloc (qt->nquestions + 1, sizeof *qt->view))) {
+      ASKME_LOG ("OOM error - failed to allocate view of %zu questions\n", qt->nquestions);
+      qtable_drop_view (qt);
+      return NULL;
+   }
+
+   char **field = qt->view_fields;
+   for (size_t i=0; i<qt->nquestions; i++) {
+      char *question = &qt->text[qt->question_offs[i]];
+      qt->view[i] = field;
+      *field++ = question;
+      *field++ = question + strlen (question) + 1;
+      for (size_t j=0; j<qt->noptions[i]; j++) {
+         *field++ = &qt->text[qt->option_offs[qt->option_start[i] + j]];
+      }
+      *field++ = NULL;
+   }
+
+   return qt->view;
+}
@@ -4,21 +4,72 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+#include <sys/stat.h>
 
 #define ASKME_LOG(...)     do {\
    printf ("%s:%i:", __FILE__, __LINE__);\
    printf (__VA_ARGS__);\
 } while (0)
 
-#define ASKME_SETBIT(num,idx)          (num |= (1 << idx))
-#define ASKME_CLRBIT(num,idx)          (num = num & ~(1 << idx))
-#define ASKME_TSTBIT(num,idx)          (num & (1 << idx))
+#define ASKME_SETBIT(num,idx)          (num |= ((uint64_t)1 << (idx)))
+#define ASKME_CLRBIT(num,idx)          (num = num & ~((uint64_t)1 << (idx)))
+#define ASKME_TSTBIT(num,idx)          (num & ((uint64_t)1 << (idx)))
 
 
 #define ASKME_QIDX_QUESTION      (0)
 #define ASKME_QIDX_ANSBMP        (1)
 #define ASKME_QIDX_OPTION_OFFS   (2)
 
+// Answers and responses are 64-bit bitmaps with option n in bit n. Bits
+// 0 and 63 are never options.
+#define ASKME_MAX_OPTIONS        (62)
+
+// The state of a running hash of a file. It can be saved and later
+// extended over whatever has been appended to the file since.
+#define ASKME_HASH_BLOCK         (32)
+
+typedef struct askme_hash_t askme_hash_t;
+struct askme_hash_t {
+   uint64_t lanes[4];
+   uint64_t len;                             // Bytes hashed so far
+   unsigned char pending[ASKME_HASH_BLOCK];  // The last len % 32 bytes
+};
+
+// A packed question table. All the strings for all the records live in a
+// single buffer (question, answer template, then each option, all nul
+// terminated) and every per-question attribute is kept in its own dense
+// array, indexed by question number. The answer bitmap is decoded once,
+// when the record is loaded.
+typedef struct askme_qtable_t askme_qtable_t;
+struct askme_qtable_t {
+   size_t nquestions;
+   size_t noptions_total;
+
+   char *text;                // All the strings for all the records
+   size_t *question_offs;     // [nquestions] Offset of question in text
+   size_t *answer;            // [nquestions] Decoded answer bitmap
+   size_t *noptions;          // [nquestions] Number of options
+   size_t *option_start;      // [nquestions] First entry in option_offs
+   size_t *option_offs;       // [noptions_total] Offset of option in text
+
+   bool trusted;              // Skip the per-field checks when loading
+
+   // Private: the hash of the lines parsed so far and how many there
+   // were, for the cache kept by askme_qtable_load().
+   askme_hash_t hash;
+   size_t nlines;
+
+   // Private: capacities of the arrays above and the compatibility view.
+   size_t text_len;
+   size_t text_cap;
+   size_t questions_cap;
+   size_t options_cap;
+   char **view_fields;
+   char ***view;
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -30,9 +81,57 @@ extern "C" {
    char ***askme_parse_qfile (FILE *inf);
    void askme_randomise_questions (char ***questions);
    size_t askme_count_questions (char ***questions);
+   // Returns 0 for a template wider than ASKME_MAX_OPTIONS.
    size_t askme_parse_answer (const char *answer_string);
    bool askme_save_grade (const char *topic, size_t correct, size_t total);
 
+   // Reads the maximum line length from the 'line-length' option.
+   bool askme_line_length (size_t *line_len);
+
+   // Records the mark that a topic has passed validation, or removes it
+   // if sb is NULL. sb must be the status of the topic taken before it
+   // was read, as the mark is only honoured for as long as the topic's
+   // size and modification time still match it.
+   bool askme_mark_validated (const char *topic, const struct stat *sb);
+   bool askme_is_validated (const char *topic);
+
+   // A hash that can be extended: the state after hashing a prefix of a
+   // file can be stored and later continued over what was appended.
+   // Compare two hashes with askme_hash_final().
+   void askme_hash_init (askme_hash_t *hash);
+   void askme_hash_update (askme_hash_t *hash, const void *data, size_t len);
+   uint64_t askme_hash_final (const askme_hash_t *hash);
+
+   // Hashes len bytes of the file starting at offset.
+   bool askme_hash_file (askme_hash_t *hash, int fd, uint64_t offset, uint64_t len);
+
+   // Averages the percentages of the last nrecent grades for the topic.
+   // Returns false if the topic has no grades.
+   bool askme_recent_grade (const char *topic, size_t nrecent, double *average);
+
+   askme_qtable_t *askme_qtable_new (void);
+   // The parsed table is cached in ~/.askme/cache/<topic>. If the topic
+   // still starts with exactly the lines that were cached, only the
+   // lines appended since are parsed; otherwise the whole topic is.
+   askme_qtable_t *askme_qtable_load (const char *topic);
+   askme_qtable_t *askme_qtable_parse (FILE *inf);
+   void askme_qtable_del (askme_qtable_t *qt);
+
+   // Splits the line (destructively) into fields and appends the record
+   // to the table. Lines without any fields are skipped.
+   bool askme_qtable_append (askme_qtable_t *qt, char *line, size_t recordnum);
+   size_t askme_qtable_count (const askme_qtable_t *qt);
+   const char *askme_qtable_question (const askme_qtable_t *qt, size_t index);
+   const char *askme_qtable_option (const askme_qtable_t *qt, size_t index, size_t option);
+   size_t *askme_qtable_order (const askme_qtable_t *qt);
+   void askme_randomise_order (size_t *order, size_t nitems, unsigned int seed);
+
+   // Returns the table in the old char *** layout (question, answer
+   // template, options, NULL). The view belongs to the table and is only
+   // valid until the table is modified or deleted; the caller must not
+   // free any part of it.
+   char ***askme_qtable_view (askme_qtable_t *qt);
+
 
 #ifdef __cplusplus
 };
@@ -0,0 +1,444 @@
+
+#define _POSIX_C_SOURCE    200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "askme_lib.h"
+
+#include "ds_str.h"
+
+/* Validates every topic file in $HOME/.askme/topics. Each file is a unit
+ * of work for the pool of worker threads, and files larger than the
+ * chunk size are split (on line boundaries) into several units so that a
+ * single large file is also scanned in parallel. Problems are reported
+ * as file:line: message, in file order, once all the workers are done.
+ */
+
+#define DEFAULT_CHUNK_SIZE       (16 * 1024 * 1024)
+#define MAX_JOBS                 (256)
+#define MSG_LEN                  (160)
+
+struct problem_t {
+   size_t line;            // Relative to the start of the chunk
+   char msg[MSG_LEN];
+};
+
+struct topic_t {
+   char *name;
+   char *path;
+   const char *data;       // The whole file, mapped
+   size_t size;
+   struct stat sb;         // Taken before mapping, for the validation mark
+   size_t nproblems;
+};
+
+struct chunk_t {
+   struct topic_t *topic;
+   size_t start;
+   size_t end;
+   size_t nlines;          // Newlines seen in this chunk
+   struct problem_t *problems;
+   size_t nproblems;
+   size_t problems_cap;
+   bool oom;
+};
+
+struct work_t {
+   struct chunk_t *chunks;
+   size_t nchunks;
+   size_t next;
+   size_t line_len;
+   pthread_mutex_t lock;
+};
+
+static void report (struct chunk_t *chunk, size_t line, const char *fmt, ...)
+{
+   if (chunk->nproblems >= chunk->problems_cap) {
+      size_t newcap = chunk->problems_cap ? chunk->problems_cap * 2 : 16;
+      struct problem_t *tmp = realloc (chunk->problems, newcap * sizeof *tmp);
+      if (!tmp) {
+         chunk->oom = true;
+         return;
+      }
+      chunk->problems = tmp;
+      chunk->problems_cap = newcap;
+   }
+
+   struct problem_t *problem = &chunk->problems[chunk->nproblems++];
+   va_list ap;
+   va_start (ap, fmt);
+   problem->line = line;
+   vsnprintf (problem->msg, sizeof problem->msg, fmt, ap);
+   va_end (ap);
+}
+
+// Checks a single line, [start, end) not including the newline, against
+// what the loader expects of a record.
+static void check_line (struct chunk_t *chunk, size_t line, size_t line_len,
+                        const char *start, const char *end)
+{
+   size_t len = end - start;
+   size_t nfields = 1;
+   size_t nempty = 0;
+   const char *answer = NULL;
+   size_t answer_len = 0;
+
+   if (len == 0)
+      return;
+
+   const char *p = start;
+   while (p < end && *p == '\t') {
+      p++;
+   }
+   if (p == end) {
+      report (chunk, line, "line consists only of tabs and will be skipped");
+      return;
+   }
+
+   if (len + 1 > line_len - 2) {
+      report (chunk, line, "line is %zu bytes long, the loader only accepts %zu "
+                           "(see the 'line-length' option)", len, line_len - 3);
+   }
+
+   if (end[-1] == '\r') {
+      report (chunk, line, "line ends with a carriage return (DOS line endings?)");
+   }
+
+   // Walk the fields the way a strict parser would; strtok_r in the
+   // loader silently drops the empty ones.
+   const char *field = start;
+   for (p = start; p <= end; p++) {
+      if (p != end && *p != '\t')
+         continue;
+      size_t flen = p - field;
+      if (!flen) {
+         nempty++;
+         report (chunk, line, "field %zu is empty and will be dropped", nfields);
+      } else if (!answer && nfields - nempty == 2) {
+         answer = field;
+         answer_len = flen;
+      }
+      if (p != end)
+         nfields++;
+      field = p + 1;
+   }
+
+   size_t nused = nfields - nempty;
+   if (nused < 2) {
+      report (chunk, line, "record has no answer template");
+      return;
+   }
+   if (nused < 3) {
+      report (chunk, line, "record has no options");
+   }
+
+   size_t noptions = nused - 2;
+   for (size_t i=0; i<answer_len; i++) {
+      if (answer[i] != '0' && answer[i] != '1') {
+         report (chunk, line, "answer template contains a '%c' at position %zu; "
+                              "only '0' and '1' are allowed", answer[i], i + 1);
+         break;
+      }
+   }
+   if (answer_len != noptions) {
+      report (chunk, line, "answer template has width %zu but there are %zu options",
+                           answer_len, noptions);
+   }
+   if (noptions > ASKME_MAX_OPTIONS) {
+      report (chunk, line, "record has %zu options, only %i are supported",
+                           noptions, ASKME_MAX_OPTIONS);
+   }
+}
+
+static void scan_chunk (struct chunk_t *chunk, size_t line_len)
+{
+   const char *data = chunk->topic->data;
+   const char *p = &data[chunk->start];
+   const char *end = &data[chunk->end];
+
+   while (p < end) {
+      const char *nl = memchr (p, '\n', end - p);
+      if (!nl) {
+         // Chunks end on a newline, so this can only be the end of file.
+         report (chunk, chunk->nlines, "last line has no newline; the loader "
+                                       "will reject the file");
+         check_line (chunk, chunk->nlines, line_len, p, end);
+         break;
+      }
+      check_line (chunk, chunk->nlines, line_len, p, nl);
+      chunk->nlines++;
+      p = nl + 1;
+   }
+}
+
+static void *worker (void *arg)
+{
+   struct work_t *work = arg;
+
+   for (;;) {
+      pthread_mutex_lock (&work->lock);
+      size_t index = work->next++;
+      pthread_mutex_unlock (&work->lock);
+
+      if (index >= work->nchunks)
+         break;
+
+      scan_chunk (&work->chunks[index], work->line_len);
+   }
+
+   return NULL;
+}
+
+static bool map_topic (struct topic_t *topic)
+{
+   bool ret = false;
+   struct stat *sb = &topic->sb;
+   int fd = open (topic->path, O_RDONLY);
+
+   if (fd < 0) {
+      ASKME_LOG ("Failed to open [%s]: %m\n", topic->path);
+      return false;
+   }
+
+   if ((fstat (fd, sb))!=0) {
+      ASKME_LOG ("Failed to stat [%s]: %m\n", topic->path);
+      goto errorexit;
+   }
+
+   if (!S_ISREG (sb->st_mode)) {
+      ASKME_LOG ("Skipping [%s]: not a regular file\n", topic->path);
+      goto errorexit;
+   }
+
+   topic->size = sb->st_size;
+   if (topic->size) {
+      void *data = mmap (NULL, topic->size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+         ASKME_LOG ("Failed to map [%s]: %m\n", topic->path);
+         goto errorexit;
+      }
+      topic->data = data;
+   }
+
+   ret = true;
+
+errorexit:
+   close (fd);
+   return ret;
+}
+
+// Splits the topic into chunks of roughly chunk_size bytes, each ending
+// just after a newline (or at the end of the file).
+static bool add_chunks (struct work_t *work, size_t *cap, struct topic_t *topic,
+                        size_t chunk_size)
+{
+   size_t start = 0;
+
+   do {
+      size_t end = start + chunk_size;
+      if (end >= topic->size) {
+         end = topic->size;
+      } else {
+         const char *nl = memchr (&topic->data[end], '\n', topic->size - end);
+         end = nl ? (size_t)(nl - topic->data) + 1 : topic->size;
+      }
+
+      if (work->nchunks >= *cap) {
+         size_t newcap = *cap ? *cap * 2 : 64;
+         struct chunk_t *tmp = realloc (work->chunks, newcap * sizeof *tmp);
+         if (!tmp) {
+            ASKME_LOG ("OOM error - cannot allocate %zu chunks\n", newcap);
+            return false;
+         }
+         work->chunks = tmp;
+         *cap = newcap;
+      }
+
+      struct chunk_t *chunk = &work->chunks[work->nchunks++];
+      memset (chunk, 0, sizeof *chunk);
+      chunk->topic = topic;
+      chunk->start = start;
+      chunk->end = end;
+      start = end;
+   } while (start < topic->size);
+
+   return true;
+}
+
+static size_t read_size_option (const char *name, size_t defval)
+{
+   size_t ret = defval;
+   if (getenv (name) && ((sscanf (getenv (name), "%zu", &ret))!=1 || !ret)) {
+      ASKME_LOG ("Unable to read [%s] as a value for %s, using %zu\n",
+                 getenv (name), name, defval);
+      ret = defval;
+   }
+   return ret;
+}
+
+static const char *help_msg[] = {
+"askme_lint: Validate the topic files used by askme",
+"  --help            This message",
+"  --jobs            Number of worker threads (default: number of CPUs)",
+"  --chunk-size      Files larger than this many bytes are split into",
+"                    chunks that are checked in parallel (default 16MB)",
+"  --line-length     The maximum line length, as for askme",
+"",
+"  Every file in $HOME/.askme/topics is checked and each problem found is",
+"reported as file:line: description. Files without any problems are",
+"marked as validated, and askme will then skip its own checks when",
+"loading them, for as long as the file remains unchanged.",
+NULL,
+};
+
+int main (int argc, char **argv)
+{
+   int ret = EXIT_FAILURE;
+   char **names = NULL;
+   struct topic_t *topics = NULL;
+   size_t ntopics = 0;
+   struct work_t work;
+   size_t chunks_cap = 0;
+   pthread_t threads[MAX_JOBS];
+   size_t nthreads = 0;
+   size_t total_problems = 0;
+
+   memset (&work, 0, sizeof work);
+   pthread_mutex_init (&work.lock, NULL);
+
+   askme_read_cline (argc, argv);
+
+   if (getenv ("help")) {
+      for (size_t i=0; help_msg[i]; i++) {
+         printf ("%s\n", help_msg[i]);
+      }
+      ret = EXIT_SUCCESS;
+      goto errorexit;
+   }
+
+   long ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+   size_t njobs = read_size_option ("jobs", ncpus > 0 ? (size_t)ncpus : 1);
+   size_t chunk_size = read_size_option ("chunk-size", DEFAULT_CHUNK_SIZE);
+   if (njobs > MAX_JOBS) {
+      njobs = MAX_JOBS;
+   }
+
+   if (!(askme_line_length (&work.line_len))) {
+      goto errorexit;
+   }
+
+   if (!(names = askme_list_topics ())) {
+      ASKME_LOG ("Failed to list the topics\n");
+      goto errorexit;
+   }
+
+   for (ntopics=0; names[ntopics]; ntopics++)
+      ;
+
+   if (!(topics = calloc (ntopics + 1, sizeof *topics))) {
+      ASKME_LOG ("OOM error - cannot allocate %zu topics\n", ntopics);
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<ntopics; i++) {
+      topics[i].name = names[i];
+      if (!(topics[i].path = askme_get_subdir ("topics/", names[i], NULL))) {
+         ASKME_LOG ("OOM error - unable to create pathname [topics/%s]\n", names[i]);
+         goto errorexit;
+      }
+      if (!(map_topic (&topics[i]))) {
+         topics[i].nproblems++;
+         continue;
+      }
+      if (!(add_chunks (&work, &chunks_cap, &topics[i], chunk_size))) {
+         goto errorexit;
+      }
+   }
+
+   if (njobs > work.nchunks) {
+      njobs = work.nchunks;
+   }
+
+   for (nthreads=0; nthreads<njobs; nthreads++) {
+      if ((pthread_create (&threads[nthreads], NULL, worker, &work))!=0) {
+         ASKME_LOG ("Failed to start worker %zu, continuing with %zu\n",
+                    nthreads + 1, nthreads);
+         break;
+      }
+   }
+   // With no workers at all, do the work on this thread.
+   if (!nthreads) {
+      worker (&work);
+   }
+   for (size_t i=0; i<nthreads; i++) {
+      pthread_join (threads[i], NULL);
+   }
+
+   // Chunks of the same topic are adjacent and in order, so the line
+   // numbers are fixed up by adding the lines of the preceding chunks.
+   size_t line_base = 0;
+   for (size_t i=0; i<work.nchunks; i++) {
+      struct chunk_t *chunk = &work.chunks[i];
+      if (i && work.chunks[i-1].topic != chunk->topic) {
+         line_base = 0;
+      }
+      if (chunk->oom) {
+         ASKME_LOG ("OOM error - some problems in [%s] were not recorded\n",
+                    chunk->topic->name);
+         chunk->topic->nproblems++;
+      }
+      for (size_t j=0; j<chunk->nproblems; j++) {
+         printf ("%s:%zu: %s\n", chunk->topic->name,
+                 line_base + chunk->problems[j].line + 1,
+                 chunk->problems[j].msg);
+      }
+      chunk->topic->nproblems += chunk->nproblems;
+      line_base += chunk->nlines;
+   }
+
+   for (size_t i=0; i<ntopics; i++) {
+      total_problems += topics[i].nproblems;
+      // Only what was mapped was checked, so the mark records the file
+      // as it was then; anything written since invalidates it.
+      const struct stat *sb = topics[i].nproblems ? NULL : &topics[i].sb;
+      if (!(askme_mark_validated (topics[i].name, sb))) {
+         ASKME_LOG ("Warning: failed to update the validation mark for [%s]\n",
+                    topics[i].name);
+      }
+   }
+
+   printf ("%zu topics checked, %zu problems found\n", ntopics, total_problems);
+   ret = total_problems ? EXIT_FAILURE : EXIT_SUCCESS;
+
+errorexit:
+   for (size_t i=0; i<work.nchunks; i++) {
+      free (work.chunks[i].problems);
+   }
+   free (work.chunks);
+
+   for (size_t i=0; topics && i<ntopics; i++) {
+      if (topics[i].data)
+         munmap ((void *)topics[i].data, topics[i].size);
+      free (topics[i].path);
+   }
+   free (topics);
+
+   for (size_t i=0; names && names[i]; i++) {
+      free (names[i]);
+   }
+   free (names);
+
+   pthread_mutex_destroy (&work.lock);
+   return ret;
+}
@@ -0,0 +1,602 @@
+
+#define _POSIX_C_SOURCE    200809L
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "askme_lib.h"
+#include "askme_qset.h"
+
+#define ARRAY_MAX          (4096)
+#define CHUNK_WORDS        (1024)
+#define CHUNK_BYTES        (CHUNK_WORDS * sizeof (uint64_t))
+
+#define KEY(value)         ((uint16_t)((value) >> 16))
+#define LOW(value)         ((uint16_t)((value) & 0xffff))
+
+struct chunk_t {
+   uint16_t key;
+   uint32_t card;
+   uint32_t cap;              // Capacity of values
+   uint16_t *values;          // [card] Sorted, when card <= ARRAY_MAX
+   uint64_t *words;           // [CHUNK_WORDS] Otherwise
+};
+
+struct askme_qset_t {
+   size_t nchunks;
+   size_t cap;
+   struct chunk_t *chunks;    // Sorted by key
+};
+
+enum qset_op_t {
+   QSET_AND,
+   QSET_OR,
+   QSET_ANDNOT,
+};
+
+static void chunk_free (struct chunk_t *chunk)
+{
+   free (chunk->values);
+   free (chunk->words);
+   memset (chunk, 0, sizeof *chunk);
+}
+
+static size_t words_card (const uint64_t *words)
+{
+   size_t ret = 0;
+   for (size_t i=0; i<CHUNK_WORDS; i++) {
+      ret += __builtin_popcountll (words[i]);
+   }
+   return ret;
+}
+
+static void chunk_to_words (const struct chunk_t *chunk, uint64_t *dst)
+{
+   if (chunk->words) {
+      memcpy (dst, chunk->words, CHUNK_BYTES);
+      return;
+   }
+   memset (dst, 0, CHUNK_BYTES);
+   for (uint32_t i=0; i<chunk->card; i++) {
+      dst[chunk->values[i] >> 6] |= UINT64_C(1) << (chunk->values[i] & 63);
+   }
+}
+
+// Fills an empty chunk from a bitmap, as an array if it is small enough.
+static bool chunk_from_words (struct chunk_t *chunk, const uint64_t *words)
+{
+   size_t card = words_card (words);
+
+   chunk->card = card;
+   if (card > ARRAY_MAX) {
+      if (!(chunk->words = malloc (CHUNK_BYTES)))
+         return false;
+      memcpy (chunk->words, words, CHUNK_BYTES);
+      return true;
+   }
+
+   if (!card)
+      return true;
+
+   if (!(chunk->values = malloc (card * sizeof *chunk->values)))
+      return false;
+   chunk->cap = card;
+
+   size_t n = 0;
+   for (size_t i=0; i<CHUNK_WORDS; i++) {
+      for (uint64_t w=words[i]; w; w &= w - 1) {
+         chunk->values[n++] = (uint16_t)(i * 64 + __builtin_ctzll (w));
+      }
+   }
+   return true;
+}
+
+static bool chunk_from_values (struct chunk_t *chunk, const uint16_t *values, size_t card)
+{
+   if (card > ARRAY_MAX) {
+      uint64_t words[CHUNK_WORDS];
+      struct chunk_t tmp = { .card = card, .values = (uint16_t *)values };
+      chunk_to_words (&tmp, words);
+      return chunk_from_words (chunk, words);
+   }
+
+   chunk->card = card;
+   if (!card)
+      return true;
+
+   if (!(chunk->values = malloc (card * sizeof *chunk->values)))
+      return false;
+   memcpy (chunk->values, values, card * sizeof *chunk->values);
+   chunk->cap = card;
+   return true;
+}
+
+static bool chunk_copy (struct chunk_t *dst, const struct chunk_t *src)
+{
+   dst->key = src->key;
+   if (src->words) {
+      return chunk_from_words (dst, src->words);
+   }
+   return chunk_from_values (dst, src->values, src->card);
+}
+
+// Position of low in a sorted array chunk, or where it would go.
+static uint32_t values_search (const struct chunk_t *chunk, uint16_t low, bool *found)
+{
+   uint32_t lo = 0, hi = chunk->card;
+   while (lo < hi) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      if (chunk->values[mid] < low) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+   *found = lo < chunk->card && chunk->values[lo] == low;
+   return lo;
+}
+
+static bool chunk_contains (const struct chunk_t *chunk, uint16_t low)
+{
+   bool found;
+   if (chunk->words)
+      return (chunk->words[low >> 6] >> (low & 63)) & 1;
+   values_search (chunk, low, &found);
+   return found;
+}
+
+static bool chunk_add (struct chunk_t *chunk, uint16_t low)
+{
+   bool found;
+
+   if (chunk->words) {
+      uint64_t bit = UINT64_C(1) << (low & 63);
+      if (!(chunk->words[low >> 6] & bit)) {
+         chunk->words[low >> 6] |= bit;
+         chunk->card++;
+      }
+      return true;
+   }
+
+   uint32_t pos = values_search (chunk, low, &found);
+   if (found)
+      return true;
+
+   if (chunk->card == ARRAY_MAX) {
+      // Too dense for an array, switch to a bitmap
+      uint64_t words[CHUNK_WORDS];
+      chunk_to_words (chunk, words);
+      words[low >> 6] |= UINT64_C(1) << (low & 63);
+      uint16_t key = chunk->key;
+      chunk_free (chunk);
+      chunk->key = key;
+      return chunk_from_words (chunk, words);
+   }
+
+   if (chunk->card == chunk->cap) {
+      uint32_t newcap = chunk->cap ? chunk->cap * 2 : 4;
+      if (newcap > ARRAY_MAX)
+         newcap = ARRAY_MAX;
+      uint16_t *tmp = realloc (chunk->values, newcap * sizeof *tmp);
+      if (!tmp)
+         return false;
+      chunk->values = tmp;
+      chunk->cap = newcap;
+   }
+
+   memmove (&chunk->values[pos + 1], &chunk->values[pos],
+            (chunk->card - pos) * sizeof *chunk->values);
+   chunk->values[pos] = low;
+   chunk->card++;
+   return true;
+}
+
+static bool chunk_remove (struct chunk_t *chunk, uint16_t low)
+{
+   bool found;
+
+   if (chunk->words) {
+      uint64_t bit = UINT64_C(1) << (low & 63);
+      if (!(chunk->words[low >> 6] & bit))
+         return true;
+
+      chunk->words[low >> 6] &= ~bit;
+      if (--chunk->card > ARRAY_MAX)
+         return true;
+
+      // Sparse enough for an array again
+      uint64_t words[CHUNK_WORDS];
+      uint16_t key = chunk->key;
+      memcpy (words, chunk->words, CHUNK_BYTES);
+      chunk_free (chunk);
+      chunk->key = key;
+      return chunk_from_words (chunk, words);
+   }
+
+   uint32_t pos = values_search (chunk, low, &found);
+   if (found) {
+      memmove (&chunk->values[pos], &chunk->values[pos + 1],
+               (chunk->card - pos - 1) * sizeof *chunk->values);
+      chunk->card--;
+   }
+   return true;
+}
+
+// Applies op to two chunks with the same key, storing the result in the
+// empty chunk dst.
+static bool chunk_op (struct chunk_t *dst, const struct chunk_t *a, const struct chunk_t *b,
+                      enum qset_op_t op)
+{
+   dst->key = a->key;
+
+   if (!a->words && !b->words) {
+      // Two sorted arrays: merge them
+      uint16_t values[ARRAY_MAX * 2];
+      size_t n = 0, i = 0, j = 0;
+      while (i < a->card && j < b->card) {
+         if (a->values[i] < b->values[j]) {
+            if (op != QSET_AND)
+               values[n++] = a->values[i];
+            i++;
+         } else if (a->values[i] > b->values[j]) {
+            if (op == QSET_OR)
+               values[n++] = b->values[j];
+            j++;
+         } else {
+            if (op != QSET_ANDNOT)
+               values[n++] = a->values[i];
+            i++;
+            j++;
+         }
+      }
+      if (op != QSET_AND) {
+         while (i < a->card)
+            values[n++] = a->values[i++];
+      }
+      if (op == QSET_OR) {
+         while (j < b->card)
+            values[n++] = b->values[j++];
+      }
+      return chunk_from_values (dst, values, n);
+   }
+
+   uint64_t awords[CHUNK_WORDS], bwords[CHUNK_WORDS];
+   chunk_to_words (a, awords);
+   chunk_to_words (b, bwords);
+   for (size_t i=0; i<CHUNK_WORDS; i++) {
+      switch (op) {
+         case QSET_AND:    awords[i] &= bwords[i];    break;
+         case QSET_OR:     awords[i] |= bwords[i];    break;
+         case QSET_ANDNOT: awords[i] &= ~bwords[i];   break;
+      }
+   }
+   return chunk_from_words (dst, awords);
+}
+
+/* ******************************************************************** */
+
+// Position of the chunk for key, or where it would go.
+static size_t chunk_search (const askme_qset_t *set, uint16_t key, bool *found)
+{
+   size_t lo = 0, hi = set->nchunks;
+   while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (set->chunks[mid].key < key) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+   *found = lo < set->nchunks && set->chunks[lo].key == key;
+   return lo;
+}
+
+static struct chunk_t *chunk_insert (askme_qset_t *set, size_t pos, uint16_t key)
+{
+   if (set->nchunks == set->cap) {
+      size_t newcap = set->cap ? set->cap * 2 : 4;
+      struct chunk_t *tmp = realloc (set->chunks, newcap * sizeof *tmp);
+      if (!tmp) {
+         ASKME_LOG ("OOM error - cannot grow set to %zu chunks\n", newcap);
+         return NULL;
+      }
+      set->chunks = tmp;
+      set->cap = newcap;
+   }
+
+   memmove (&set->chunks[pos + 1], &set->chunks[pos],
+            (set->nchunks - pos) * sizeof *set->chunks);
+   memset (&set->chunks[pos], 0, sizeof set->chunks[pos]);
+   set->chunks[pos].key = key;
+   set->nchunks++;
+   return &set->chunks[pos];
+}
+
+// Appends a chunk to a set being built in key order. Empty chunks are
+// dropped.
+static bool chunk_push (askme_qset_t *set, struct chunk_t *chunk)
+{
+   struct chunk_t *dst;
+
+   if (!chunk->card) {
+      chunk_free (chunk);
+      return true;
+   }
+
+   if (!(dst = chunk_insert (set, set->nchunks, chunk->key))) {
+      chunk_free (chunk);
+      return false;
+   }
+   *dst = *chunk;
+   return true;
+}
+
+askme_qset_t *askme_qset_new (void)
+{
+   askme_qset_t *ret = calloc (1, sizeof *ret);
+   if (!ret) {
+      ASKME_LOG ("OOM error - cannot allocate set\n");
+   }
+   return ret;
+}
+
+void askme_qset_del (askme_qset_t *set)
+{
+   if (!set)
+      return;
+
+   for (size_t i=0; i<set->nchunks; i++) {
+      chunk_free (&set->chunks[i]);
+   }
+   free (set->chunks);
+   free (set);
+}
+
+askme_qset_t *askme_qset_copy (const askme_qset_t *set)
+{
+   askme_qset_t *ret = askme_qset_new ();
+
+   for (size_t i=0; ret && i<set->nchunks; i++) {
+      struct chunk_t chunk = { 0 };
+      if (!(chunk_copy (&chunk, &set->chunks[i])) || !(chunk_push (ret, &chunk))) {
+         chunk_free (&chunk);
+         askme_qset_del (ret);
+         ret = NULL;
+      }
+   }
+
+   return ret;
+}
+
+askme_qset_t *askme_qset_range (uint32_t nitems)
+{
+   askme_qset_t *ret = askme_qset_new ();
+   uint64_t words[CHUNK_WORDS];
+
+   for (uint64_t start=0; ret && start<nitems; start += 0x10000) {
+      struct chunk_t chunk = { .key = KEY (start) };
+      uint64_t n = nitems - start < 0x10000 ? nitems - start : 0x10000;
+
+      memset (words, 0, CHUNK_BYTES);
+      memset (words, 0xff, (n / 64) * sizeof *words);
+      if (n % 64) {
+         words[n / 64] = (UINT64_C(1) << (n % 64)) - 1;
+      }
+
+      if (!(chunk_from_words (&chunk, words)) || !(chunk_push (ret, &chunk))) {
+         chunk_free (&chunk);
+         askme_qset_del (ret);
+         ret = NULL;
+      }
+   }
+
+   return ret;
+}
+
+bool askme_qset_add (askme_qset_t *set, uint32_t value)
+{
+   bool found;
+   size_t pos = chunk_search (set, KEY (value), &found);
+   struct chunk_t *chunk = found ? &set->chunks[pos] : chunk_insert (set, pos, KEY (value));
+
+   if (!chunk || !(chunk_add (chunk, LOW (value)))) {
+      ASKME_LOG ("OOM error - cannot add [%u] to set\n", value);
+      return false;
+   }
+   return true;
+}
+
+bool askme_qset_remove (askme_qset_t *set, uint32_t value)
+{
+   bool found;
+   size_t pos = chunk_search (set, KEY (value), &found);
+
+   if (!found)
+      return true;
+
+   if (!(chunk_remove (&set->chunks[pos], LOW (value)))) {
+      ASKME_LOG ("OOM error - cannot remove [%u] from set\n", value);
+      return false;
+   }
+
+   if (!set->chunks[pos].card) {
+      chunk_free (&set->chunks[pos]);
+      memmove (&set->chunks[pos], &set->chunks[pos + 1],
+               (set->nchunks - pos - 1) * sizeof *set->chunks);
+      set->nchunks--;
+   }
+   return true;
+}
+
+bool askme_qset_contains (const askme_qset_t *set, uint32_t value)
+{
+   bool found;
+   size_t pos = chunk_search (set, KEY (value), &found);
+   return found && chunk_contains (&set->chunks[pos], LOW (value));
+}
+
+size_t askme_qset_count (const askme_qset_t *set)
+{
+   size_t ret = 0;
+   for (size_t i=0; i<set->nchunks; i++) {
+      ret += set->chunks[i].card;
+   }
+   return ret;
+}
+
+static askme_qset_t *qset_op (const askme_qset_t *a, const askme_qset_t *b, enum qset_op_t op)
+{
+   askme_qset_t *ret = askme_qset_new ();
+   size_t i = 0, j = 0;
+
+   if (!ret)
+      return NULL;
+
+   // Chunks in only one of the sets are copied or skipped whole.
+   while (i < a->nchunks || j < b->nchunks) {
+      struct chunk_t chunk = { 0 };
+      bool ok = true;
+
+      if (j == b->nchunks || (i < a->nchunks && a->chunks[i].key < b->chunks[j].key)) {
+         if (op != QSET_AND)
+            ok = chunk_copy (&chunk, &a->chunks[i]);
+         i++;
+      } else if (i == a->nchunks || a->chunks[i].key > b->chunks[j].key) {
+         if (op == QSET_OR)
+            ok = chunk_copy (&chunk, &b->chunks[j]);
+         j++;
+      } else {
+         ok = chunk_op (&chunk, &a->chunks[i], &b->chunks[j], op);
+         i++;
+         j++;
+      }
+
+      if (!ok || !(chunk_push (ret, &chunk))) {
+         ASKME_LOG ("OOM error - cannot combine sets\n");
+         chunk_free (&chunk);
+         askme_qset_del (ret);
+         return NULL;
+      }
+   }
+
+   return ret;
+}
+
+askme_qset_t *askme_qset_and (const askme_qset_t *a, const askme_qset_t *b)
+{
+   return qset_op (a, b, QSET_AND);
+}
+
+askme_qset_t *askme_qset_or (const askme_qset_t *a, const askme_qset_t *b)
+{
+   return qset_op (a, b, QSET_OR);
+}
+
+askme_qset_t *askme_qset_andnot (const askme_qset_t *a, const askme_qset_t *b)
+{
+   return qset_op (a, b, QSET_ANDNOT);
+}
+
+void askme_qset_fill (const askme_qset_t *set, size_t *dst)
+{
+   for (size_t i=0; i<set->nchunks; i++) {
+      const struct chunk_t *chunk = &set->chunks[i];
+      size_t high = (size_t)chunk->key << 16;
+
+      if (!chunk->words) {
+         for (uint32_t j=0; j<chunk->card; j++) {
+            *dst++ = high | chunk->values[j];
+         }
+         continue;
+      }
+
+      for (size_t j=0; j<CHUNK_WORDS; j++) {
+         for (uint64_t w=chunk->words[j]; w; w &= w - 1) {
+            *dst++ = high | (j * 64 + __builtin_ctzll (w));
+         }
+      }
+   }
+}
+
+/* Stored as the number of chunks followed by each chunk: its key, its
+ * cardinality and then either the array or the bitmap, which one
+ * following from the cardinality. Everything is in host byte order, as
+ * the sets never leave the machine they were made on.
+ */
+bool askme_qset_write (const askme_qset_t *set, FILE *outf)
+{
+   uint64_t nchunks = set->nchunks;
+
+   if ((fwrite (&nchunks, sizeof nchunks, 1, outf))!=1)
+      return false;
+
+   for (size_t i=0; i<set->nchunks; i++) {
+      const struct chunk_t *chunk = &set->chunks[i];
+      uint32_t header[2] = { chunk->key, chunk->card };
+
+      if ((fwrite (header, sizeof header, 1, outf))!=1)
+         return false;
+
+      if (chunk->words) {
+         if ((fwrite (chunk->words, CHUNK_BYTES, 1, outf))!=1)
+            return false;
+      } else if ((fwrite (chunk->values, sizeof *chunk->values, chunk->card, outf))!=chunk->card) {
+         return false;
+      }
+   }
+
+   return true;
+}
+
+askme_qset_t *askme_qset_read (FILE *inf)
+{
+   askme_qset_t *ret = NULL;
+   uint64_t nchunks;
+
+   if ((fread (&nchunks, sizeof nchunks, 1, inf))!=1 || nchunks > 0x10000)
+      return NULL;
+
+   if (!(ret = askme_qset_new ()))
+      return NULL;
+
+   for (uint64_t i=0; i<nchunks; i++) {
+      uint32_t header[2];
+      struct chunk_t chunk = { 0 };
+      bool ok = false;
+
+      if ((fread (header, sizeof header, 1, inf))!=1
+            || header[0] > 0xffff
+            || header[1] == 0 || header[1] > 0x10000
+            || (ret->nchunks && ret->chunks[ret->nchunks - 1].key >= header[0])) {
+         goto errorexit;
+      }
+
+      chunk.key = header[0];
+      if (header[1] > ARRAY_MAX) {
+         uint64_t words[CHUNK_WORDS];
+         ok = (fread (words, CHUNK_BYTES, 1, inf))==1
+           && words_card (words) == header[1]
+           && chunk_from_words (&chunk, words);
+      } else {
+         uint16_t values[ARRAY_MAX];
+         ok = (fread (values, sizeof *values, header[1], inf))==header[1]
+           && chunk_from_values (&chunk, values, header[1]);
+         for (uint32_t j=1; ok && j<header[1]; j++) {
+            ok = values[j - 1] < values[j];
+         }
+      }
+
+      if (!ok || !(chunk_push (ret, &chunk))) {
+         chunk_free (&chunk);
+         goto errorexit;
+      }
+   }
+
+   return ret;
+
+errorexit:
+   askme_qset_del (ret);
+   return NULL;
+}
+
@@ -0,0 +1,58 @@
+#ifndef H_ASKME_QSET
+#define H_ASKME_QSET
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A compressed set of question indexes, laid out the way Roaring bitmaps
+ * are. The 32-bit index space is split into chunks of 65536 by the top
+ * 16 bits of each index, and only chunks holding at least one index are
+ * stored. A chunk is kept in one of two forms:
+ *    array:   a sorted list of the low 16 bits, for chunks with at most
+ *             4096 members (at most 8KB, and small sets cost only their
+ *             size);
+ *    bitmap:  1024 64-bit words, for denser chunks (always 8KB).
+ * Intersections, unions and differences work a chunk at a time, merging
+ * arrays or combining whole words, so they cost a few microseconds per
+ * chunk however many members each chunk has.
+ */
+
+typedef struct askme_qset_t askme_qset_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   askme_qset_t *askme_qset_new (void);
+   void askme_qset_del (askme_qset_t *set);
+   askme_qset_t *askme_qset_copy (const askme_qset_t *set);
+
+   // The set of every index in [0, nitems).
+   askme_qset_t *askme_qset_range (uint32_t nitems);
+
+   bool askme_qset_add (askme_qset_t *set, uint32_t value);
+   bool askme_qset_remove (askme_qset_t *set, uint32_t value);
+   bool askme_qset_contains (const askme_qset_t *set, uint32_t value);
+   size_t askme_qset_count (const askme_qset_t *set);
+
+   // Each returns a new set, leaving a and b unchanged.
+   askme_qset_t *askme_qset_and (const askme_qset_t *a, const askme_qset_t *b);
+   askme_qset_t *askme_qset_or (const askme_qset_t *a, const askme_qset_t *b);
+   askme_qset_t *askme_qset_andnot (const askme_qset_t *a, const askme_qset_t *b);
+
+   // Stores the members in ascending order in dst, which must have room
+   // for askme_qset_count() elements.
+   void askme_qset_fill (const askme_qset_t *set, size_t *dst);
+
+   bool askme_qset_write (const askme_qset_t *set, FILE *outf);
+   askme_qset_t *askme_qset_read (FILE *inf);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
+
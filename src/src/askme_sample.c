@@ -0,0 +1,481 @@
+
+#define _POSIX_C_SOURCE    200809L
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "askme_lib.h"
+#include "askme_index.h"
+#include "askme_sample.h"
+
+#include "ds_str.h"
+
+#define RECENT_GRADES         (5)
+#define DEFAULT_WEIGHT        (100.0)
+#define MIN_WEIGHT            (1.0)
+
+/* ******************************************************************** */
+
+static uint64_t rng_next (uint64_t *state)
+{
+   // xorshift64*
+   uint64_t x = *state;
+   x ^= x >> 12;
+   x ^= x << 25;
+   x ^= x >> 27;
+   *state = x;
+   return x * UINT64_C(0x2545F4914F6CDD1D);
+}
+
+static uint64_t rng_seed (unsigned int seed)
+{
+   // splitmix64, so that small seeds still give a well-mixed state
+   uint64_t z = (uint64_t)seed + UINT64_C(0x9E3779B97F4A7C15);
+   z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+   z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+   z ^= z >> 31;
+   return z ? z : 1;
+}
+
+static size_t rng_below (uint64_t *state, size_t n)
+{
+   return rng_next (state) % n;
+}
+
+static double rng_unit (uint64_t *state)
+{
+   return (rng_next (state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* ******************************************************************** */
+
+struct alias_t {
+   size_t n;
+   double *prob;
+   size_t *alias;
+   double *scaled;
+   size_t *small;
+   size_t *large;
+};
+
+static void alias_free (struct alias_t *at)
+{
+   free (at->prob);
+   free (at->alias);
+   free (at->scaled);
+   free (at->small);
+   free (at->large);
+   memset (at, 0, sizeof *at);
+}
+
+static bool alias_alloc (struct alias_t *at, size_t n)
+{
+   at->n = n;
+   if (!(at->prob = calloc (n, sizeof *at->prob))
+         || !(at->alias = calloc (n, sizeof *at->alias))
+         || !(at->scaled = calloc (n, sizeof *at->scaled))
+         || !(at->small = calloc (n, sizeof *at->small))
+         || !(at->large = calloc (n, sizeof *at->large))) {
+      ASKME_LOG ("OOM error - cannot allocate alias table of %zu entries\n", n);
+      alias_free (at);
+      return false;
+   }
+   return true;
+}
+
+// Vose's method. Returns false if no weight is positive.
+static bool alias_build (struct alias_t *at, const double *weights)
+{
+   double total = 0.0;
+   size_t nsmall = 0, nlarge = 0;
+
+   for (size_t i=0; i<at->n; i++) {
+      total += weights[i];
+   }
+   if (!(total > 0.0))
+      return false;
+
+   for (size_t i=0; i<at->n; i++) {
+      at->scaled[i] = weights[i] * at->n / total;
+      at->alias[i] = i;
+      if (at->scaled[i] < 1.0) {
+         at->small[nsmall++] = i;
+      } else {
+         at->large[nlarge++] = i;
+      }
+   }
+
+   while (nsmall && nlarge) {
+      size_t l = at->small[--nsmall];
+      size_t g = at->large[--nlarge];
+      at->prob[l] = at->scaled[l];
+      at->alias[l] = g;
+      at->scaled[g] = (at->scaled[g] + at->scaled[l]) - 1.0;
+      if (at->scaled[g] < 1.0) {
+         at->small[nsmall++] = g;
+      } else {
+         at->large[nlarge++] = g;
+      }
+   }
+   while (nlarge) {
+      at->prob[at->large[--nlarge]] = 1.0;
+   }
+   // Only left over through rounding error.
+   while (nsmall) {
+      at->prob[at->small[--nsmall]] = 1.0;
+   }
+
+   return true;
+}
+
+static size_t alias_draw (const struct alias_t *at, uint64_t *rng)
+{
+   size_t i = rng_below (rng, at->n);
+   return rng_unit (rng) < at->prob[i] ? i : at->alias[i];
+}
+
+/* ******************************************************************** */
+
+// Open-addressed set of (topic, record) pairs already drawn, sized by
+// the number of questions wanted rather than the size of the topics.
+struct drawn_t {
+   uint64_t *keys;
+   size_t mask;
+};
+
+static bool drawn_alloc (struct drawn_t *ds, size_t nquestions)
+{
+   size_t cap = 16;
+   while (cap < nquestions * 2) {
+      cap *= 2;
+   }
+   ds->mask = cap - 1;
+   if (!(ds->keys = calloc (cap, sizeof *ds->keys))) {
+      ASKME_LOG ("OOM error - cannot allocate set of %zu entries\n", cap);
+      return false;
+   }
+   return true;
+}
+
+// Returns false if the pair is already in the set.
+static bool drawn_insert (struct drawn_t *ds, size_t ntopics, size_t topic, size_t record)
+{
+   uint64_t key = (uint64_t)record * ntopics + topic + 1;
+   size_t slot = (key * UINT64_C(0x9E3779B97F4A7C15)) >> 17 & ds->mask;
+
+   while (ds->keys[slot]) {
+      if (ds->keys[slot] == key)
+         return false;
+      slot = (slot + 1) & ds->mask;
+   }
+   ds->keys[slot] = key;
+   return true;
+}
+
+/* ******************************************************************** */
+
+static double weight_from_grades (const char *topic)
+{
+   double average;
+   if (!(askme_recent_grade (topic, RECENT_GRADES, &average)))
+      return DEFAULT_WEIGHT;
+
+   double ret = 100.0 - average;
+   return ret < MIN_WEIGHT ? MIN_WEIGHT : ret;
+}
+
+static bool add_topic (askme_sample_t *sample, const char *name, double weight)
+{
+   char **topics = realloc (sample->topics, (sample->ntopics + 1) * sizeof *topics);
+   if (!topics) {
+      ASKME_LOG ("OOM error - cannot add topic [%s]\n", name);
+      return false;
+   }
+   sample->topics = topics;
+
+   double *weights = realloc (sample->weights, (sample->ntopics + 1) * sizeof *weights);
+   if (!weights) {
+      ASKME_LOG ("OOM error - cannot add topic [%s]\n", name);
+      return false;
+   }
+   sample->weights = weights;
+
+   if (!(sample->topics[sample->ntopics] = ds_str_dup (name))) {
+      ASKME_LOG ("OOM error - cannot add topic [%s]\n", name);
+      return false;
+   }
+   sample->weights[sample->ntopics] = weight;
+   sample->ntopics++;
+   return true;
+}
+
+static bool parse_spec (askme_sample_t *sample, const char *spec)
+{
+   bool error = true;
+   char *copy = NULL;
+   char **all = NULL;
+
+   if (!spec || !spec[0]) {
+      if (!(all = askme_list_topics ())) {
+         goto errorexit;
+      }
+      for (size_t i=0; all[i]; i++) {
+         if (!(add_topic (sample, all[i], weight_from_grades (all[i]))))
+            goto errorexit;
+      }
+      error = false;
+      goto errorexit;
+   }
+
+   if (!(copy = ds_str_dup (spec))) {
+      ASKME_LOG ("OOM error - cannot copy [%s]\n", spec);
+      goto errorexit;
+   }
+
+   char *saveptr = NULL;
+   for (char *item = strtok_r (copy, ",", &saveptr);
+        item;
+        item = strtok_r (NULL, ",", &saveptr)) {
+      double weight;
+      char *colon = strrchr (item, ':');
+      if (colon) {
+         *colon++ = 0;
+         if ((sscanf (colon, "%lf", &weight))!=1 || weight < 0.0) {
+            ASKME_LOG ("Unable to read [%s] as a weight for topic [%s]\n", colon, item);
+            goto errorexit;
+         }
+      } else {
+         weight = weight_from_grades (item);
+      }
+      if (!(add_topic (sample, item, weight)))
+         goto errorexit;
+   }
+
+   error = false;
+
+errorexit:
+   for (size_t i=0; all && all[i]; i++) {
+      free (all[i]);
+   }
+   free (all);
+   free (copy);
+   return !error;
+}
+
+askme_sample_t *askme_sample_new (const char *spec, size_t nquestions,
+                                  unsigned int seed)
+{
+   bool error = true;
+   askme_sample_t *ret = NULL;
+   askme_index_t **indexes = NULL;
+   size_t *counts = NULL;
+   size_t *ndrawn = NULL;
+   double *live = NULL;
+   struct alias_t at = { 0 };
+   struct drawn_t drawn = { 0 };
+   uint64_t rng = rng_seed (seed);
+
+   if (!(ret = calloc (1, sizeof *ret))
+         || !(ret->qt = askme_qtable_new ())) {
+      ASKME_LOG ("OOM error - cannot allocate sample\n");
+      goto errorexit;
+   }
+
+   if (!(parse_spec (ret, spec))) {
+      goto errorexit;
+   }
+
+   if (!ret->ntopics) {
+      ASKME_LOG ("No topics to sample from\n");
+      goto errorexit;
+   }
+
+   if (!(indexes = calloc (ret->ntopics, sizeof *indexes))
+         || !(counts = calloc (ret->ntopics, sizeof *counts))
+         || !(ndrawn = calloc (ret->ntopics, sizeof *ndrawn))) {
+      ASKME_LOG ("OOM error - cannot allocate %zu topics\n", ret->ntopics);
+      goto errorexit;
+   }
+
+   size_t available = 0;
+   for (size_t i=0; i<ret->ntopics; i++) {
+      if (!(indexes[i] = askme_index_open (ret->topics[i]))) {
+         ASKME_LOG ("Failed to index topic [%s]\n", ret->topics[i]);
+         goto errorexit;
+      }
+      counts[i] = askme_index_count (indexes[i]);
+      if (!counts[i]) {
+         ret->weights[i] = 0.0;
+      }
+      if (ret->weights[i] > 0.0) {
+         available += counts[i];
+      }
+   }
+
+   if (nquestions > available) {
+      nquestions = available;
+   }
+
+   if (!(ret->topic = calloc (nquestions + 1, sizeof *ret->topic))
+         || !(ret->record = calloc (nquestions + 1, sizeof *ret->record))
+         || !(drawn_alloc (&drawn, nquestions))
+         || !(alias_alloc (&at, ret->ntopics))) {
+      ASKME_LOG ("OOM error - cannot allocate sample of %zu questions\n", nquestions);
+      goto errorexit;
+   }
+
+   // The weights are used for the alias table, so a copy is kept in
+   // order to take exhausted topics out of it.
+   if (!(live = malloc (ret->ntopics * sizeof *live))) {
+      ASKME_LOG ("OOM error - cannot allocate %zu weights\n", ret->ntopics);
+      goto errorexit;
+   }
+   memcpy (live, ret->weights, ret->ntopics * sizeof *live);
+
+   if (nquestions && !(alias_build (&at, live))) {
+      ASKME_LOG ("All topics have a weight of zero\n");
+      goto errorexit;
+   }
+
+   // Duplicates are redrawn, so bound the number of attempts in case the
+   // weights leave almost nothing undrawn.
+   size_t attempts = nquestions * 64 + 1024;
+   size_t n = 0;
+   while (n < nquestions && attempts--) {
+      size_t t = alias_draw (&at, &rng);
+      size_t r = rng_below (&rng, counts[t]);
+
+      if (!(drawn_insert (&drawn, ret->ntopics, t, r)))
+         continue;
+
+      char *line = askme_index_read (indexes[t], r);
+      if (!line) {
+         goto errorexit;
+      }
+      bool added = askme_qtable_append (ret->qt, line, r);
+      free (line);
+      if (!added || ret->qt->nquestions != n + 1) {
+         ASKME_LOG ("Failed to load record %zu from topic [%s]\n", r, ret->topics[t]);
+         goto errorexit;
+      }
+
+      ret->topic[n] = t;
+      ret->record[n] = r;
+      n++;
+
+      if (++ndrawn[t] == counts[t]) {
+         live[t] = 0.0;
+         if (n < nquestions && !(alias_build (&at, live)))
+            break;
+      }
+   }
+
+   if (n < nquestions) {
+      ASKME_LOG ("Warning: only %zu of %zu questions could be sampled\n", n, nquestions);
+   }
+
+   error = false;
+
+errorexit:
+   for (size_t i=0; indexes && i<ret->ntopics; i++) {
+      askme_index_close (indexes[i]);
+   }
+   free (indexes);
+   free (counts);
+   free (ndrawn);
+   free (live);
+   free (drawn.keys);
+   alias_free (&at);
+
+   if (error) {
+      askme_sample_del (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+askme_sample_t *askme_sample_load (char **topics, size_t ntopics,
+                                   const size_t *topic, const size_t *record,
+                                   size_t nquestions)
+{
+   bool error = true;
+   askme_sample_t *ret = NULL;
+   askme_index_t **indexes = NULL;
+
+   if (!(ret = calloc (1, sizeof *ret))
+         || !(ret->qt = askme_qtable_new ())
+         || !(indexes = calloc (ntopics, sizeof *indexes))
+         || !(ret->topic = calloc (nquestions + 1, sizeof *ret->topic))
+         || !(ret->record = calloc (nquestions + 1, sizeof *ret->record))) {
+      ASKME_LOG ("OOM error - cannot allocate sample\n");
+      goto errorexit;
+   }
+
+   // The weights played their part when the questions were drawn.
+   for (size_t i=0; i<ntopics; i++) {
+      if (!(add_topic (ret, topics[i], 0.0)))
+         goto errorexit;
+      if (!(indexes[i] = askme_index_open (topics[i]))) {
+         ASKME_LOG ("Failed to index topic [%s]\n", topics[i]);
+         goto errorexit;
+      }
+   }
+
+   for (size_t n=0; n<nquestions; n++) {
+      size_t t = topic[n];
+      size_t r = record[n];
+
+      if (t >= ntopics || r >= askme_index_count (indexes[t])) {
+         ASKME_LOG ("Topic [%s] no longer has record %zu\n",
+                    t < ntopics ? topics[t] : "?", r);
+         goto errorexit;
+      }
+
+      char *line = askme_index_read (indexes[t], r);
+      if (!line) {
+         goto errorexit;
+      }
+      bool added = askme_qtable_append (ret->qt, line, r);
+      free (line);
+      if (!added || ret->qt->nquestions != n + 1) {
+         ASKME_LOG ("Failed to load record %zu from topic [%s]\n", r, topics[t]);
+         goto errorexit;
+      }
+
+      ret->topic[n] = t;
+      ret->record[n] = r;
+   }
+
+   error = false;
+
+errorexit:
+   for (size_t i=0; indexes && i<ntopics; i++) {
+      askme_index_close (indexes[i]);
+   }
+   free (indexes);
+
+   if (error) {
+      askme_sample_del (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+void askme_sample_del (askme_sample_t *sample)
+{
+   if (!sample)
+      return;
+
+   for (size_t i=0; i<sample->ntopics; i++) {
+      free (sample->topics[i]);
+   }
+   free (sample->topics);
+   free (sample->weights);
+   free (sample->topic);
+   free (sample->record);
+   askme_qtable_del (sample->qt);
+   free (sample);
+}
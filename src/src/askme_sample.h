@@ -0,0 +1,51 @@
+#ifndef H_ASKME_SAMPLE
+#define H_ASKME_SAMPLE
+
+#include <stddef.h>
+
+#include "askme_lib.h"
+
+/* Weighted sampling of questions across several topics. Topics are
+ * chosen with a Walker/Vose alias table so that each draw is O(1), and
+ * the record within the chosen topic is read straight from disk through
+ * the topic's line-offset index (see askme_index.h). Only the sampled
+ * records are ever read, so time and memory depend on the number of
+ * questions asked and not on the size of the topics.
+ *
+ * The specification is a comma-separated list of topics, each with an
+ * optional weight:
+ *    topic-a:3,topic-b:0.5,topic-c
+ * Topics without a weight are weighted by their recent grades: the
+ * worse the recent grades, the higher the weight. An empty
+ * specification selects every topic, all weighted by their grades.
+ */
+
+typedef struct askme_sample_t askme_sample_t;
+struct askme_sample_t {
+   askme_qtable_t *qt;     // The sampled questions
+   size_t ntopics;
+   char **topics;          // [ntopics]
+   double *weights;        // [ntopics]
+   size_t *topic;          // [qt->nquestions] Topic of each question
+   size_t *record;         // [qt->nquestions] Record number in that topic
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   askme_sample_t *askme_sample_new (const char *spec, size_t nquestions,
+                                     unsigned int seed);
+   // Rebuilds a sample from the topic and record of each question, as
+   // recorded in the journal of an interrupted session.
+   askme_sample_t *askme_sample_load (char **topics, size_t ntopics,
+                                      const size_t *topic, const size_t *record,
+                                      size_t nquestions);
+   void askme_sample_del (askme_sample_t *sample);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
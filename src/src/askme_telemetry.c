@@ -0,0 +1,316 @@
+
+#define _POSIX_C_SOURCE    200809L
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "askme_lib.h"
+#include "askme_telemetry.h"
+
+#include "ds_str.h"
+
+#define OUTPUT_BUFFER_SIZE       (64 * 1024)
+#define MAX_PHASES               (16)
+
+struct question_t {
+   size_t topic;           // Index into topics
+   size_t position;
+   size_t question;
+   uint64_t latency_ns;
+   size_t retries;
+   int correct;            // -1 if never graded
+};
+
+struct phase_t {
+   const char *name;
+   uint64_t start_ns;
+   uint64_t end_ns;
+};
+
+struct askme_telemetry_t {
+   FILE *outf;
+   char *fname;
+   uint64_t epoch_ns;
+
+   struct phase_t phases[MAX_PHASES];
+   size_t nphases;
+
+   uint64_t question_start_ns;
+   size_t question_retries;
+
+   struct question_t *questions;
+   size_t nquestions;
+   size_t questions_cap;
+
+   char **topics;
+   size_t ntopics;
+};
+
+static uint64_t now_ns (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static double to_ms (uint64_t ns)
+{
+   return (double)ns / 1000000.0;
+}
+
+static void write_json_string (FILE *outf, const char *src)
+{
+   fputc ('"', outf);
+   for (; *src; src++) {
+      unsigned char c = *src;
+      switch (c) {
+         case '"':   fputs ("\\\"", outf);   break;
+         case '\\':  fputs ("\\\\", outf);   break;
+         case '\n':  fputs ("\\n", outf);    break;
+         case '\r':  fputs ("\\r", outf);    break;
+         case '\t':  fputs ("\\t", outf);    break;
+         default:
+            if (c < 0x20) {
+               fprintf (outf, "\\u%04x", c);
+            } else {
+               fputc (c, outf);
+            }
+      }
+   }
+   fputc ('"', outf);
+}
+
+askme_telemetry_t *askme_telemetry_new (const char *fname)
+{
+   askme_telemetry_t *ret = NULL;
+
+   if (!(ret = calloc (1, sizeof *ret))) {
+      ASKME_LOG ("OOM error - cannot allocate telemetry\n");
+      return NULL;
+   }
+
+   if (!(ret->fname = ds_str_dup (fname))) {
+      ASKME_LOG ("OOM error - cannot copy [%s]\n", fname);
+      goto errorexit;
+   }
+
+   if (!(ret->outf = fopen (fname, "wt"))) {
+      ASKME_LOG ("Failed to open [%s]: %m\n", fname);
+      goto errorexit;
+   }
+   setvbuf (ret->outf, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+
+   ret->epoch_ns = now_ns ();
+   return ret;
+
+errorexit:
+   free (ret->fname);
+   free (ret);
+   return NULL;
+}
+
+void askme_telemetry_phase (askme_telemetry_t *tm, const char *name)
+{
+   if (!tm)
+      return;
+
+   uint64_t now = now_ns ();
+   if (tm->nphases) {
+      tm->phases[tm->nphases - 1].end_ns = now;
+   }
+
+   if (!name || tm->nphases >= MAX_PHASES)
+      return;
+
+   tm->phases[tm->nphases].name = name;
+   tm->phases[tm->nphases].start_ns = now;
+   tm->phases[tm->nphases].end_ns = now;
+   tm->nphases++;
+}
+
+void askme_telemetry_question_begin (askme_telemetry_t *tm)
+{
+   if (!tm)
+      return;
+
+   tm->question_start_ns = now_ns ();
+   tm->question_retries = 0;
+}
+
+void askme_telemetry_question_retry (askme_telemetry_t *tm)
+{
+   if (!tm)
+      return;
+
+   tm->question_retries++;
+}
+
+static size_t find_topic (askme_telemetry_t *tm, const char *topic)
+{
+   for (size_t i=0; i<tm->ntopics; i++) {
+      if ((strcmp (tm->topics[i], topic))==0)
+         return i;
+   }
+
+   char *copy = ds_str_dup (topic);
+   char **tmp = realloc (tm->topics, (tm->ntopics + 1) * sizeof *tmp);
+   if (!copy || !tmp) {
+      ASKME_LOG ("OOM error - cannot record topic [%s]\n", topic);
+      free (copy);
+      if (tmp)
+         tm->topics = tmp;
+      return (size_t)-1;
+   }
+   tm->topics = tmp;
+   tm->topics[tm->ntopics] = copy;
+   return tm->ntopics++;
+}
+
+void askme_telemetry_question_end (askme_telemetry_t *tm, const char *topic,
+                                   size_t position, size_t question)
+{
+   if (!tm)
+      return;
+
+   uint64_t latency = now_ns () - tm->question_start_ns;
+
+   size_t topic_index = find_topic (tm, topic);
+   if (topic_index == (size_t)-1)
+      return;
+
+   if (tm->nquestions >= tm->questions_cap) {
+      size_t newcap = tm->questions_cap ? tm->questions_cap * 2 : 64;
+      struct question_t *tmp = realloc (tm->questions, newcap * sizeof *tmp);
+      if (!tmp) {
+         ASKME_LOG ("OOM error - dropping telemetry for question %zu\n", position);
+         return;
+      }
+      tm->questions = tmp;
+      tm->questions_cap = newcap;
+   }
+
+   struct question_t *rec = &tm->questions[tm->nquestions++];
+   rec->topic = topic_index;
+   rec->position = position;
+   rec->question = question;
+   rec->latency_ns = latency;
+   rec->retries = tm->question_retries;
+   rec->correct = -1;
+}
+
+void askme_telemetry_grade (askme_telemetry_t *tm, size_t position, bool correct)
+{
+   if (!tm || !tm->nquestions)
+      return;
+
+   // Questions are recorded in the order that they are asked, so the
+   // position maps directly onto the record.
+   size_t index = position - tm->questions[0].position;
+   if (position < tm->questions[0].position || index >= tm->nquestions)
+      return;
+
+   tm->questions[index].correct = correct ? 1 : 0;
+}
+
+static int cmp_u64 (const void *lhs, const void *rhs)
+{
+   uint64_t a = *(const uint64_t *)lhs;
+   uint64_t b = *(const uint64_t *)rhs;
+   return a < b ? -1 : a > b ? 1 : 0;
+}
+
+// Nearest-rank percentile of a sorted array.
+static uint64_t percentile (const uint64_t *sorted, size_t n, unsigned int p)
+{
+   size_t rank = (n * p + 99) / 100;
+   return sorted[rank ? rank - 1 : 0];
+}
+
+static bool write_summary (askme_telemetry_t *tm)
+{
+   uint64_t *latencies = NULL;
+
+   if (!tm->nquestions)
+      return true;
+
+   if (!(latencies = malloc (tm->nquestions * sizeof *latencies))) {
+      ASKME_LOG ("OOM error - cannot summarise %zu questions\n", tm->nquestions);
+      return false;
+   }
+
+   for (size_t t=0; t<tm->ntopics; t++) {
+      size_t n = 0;
+      size_t retries = 0;
+      for (size_t i=0; i<tm->nquestions; i++) {
+         if (tm->questions[i].topic == t) {
+            latencies[n++] = tm->questions[i].latency_ns;
+            retries += tm->questions[i].retries;
+         }
+      }
+      if (!n)
+         continue;
+
+      qsort (latencies, n, sizeof *latencies, cmp_u64);
+
+      fputs ("{\"type\":\"summary\",\"topic\":", tm->outf);
+      write_json_string (tm->outf, tm->topics[t]);
+      fprintf (tm->outf, ",\"questions\":%zu,\"retries\":%zu"
+                         ",\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f}\n",
+               n, retries,
+               to_ms (percentile (latencies, n, 50)),
+               to_ms (percentile (latencies, n, 90)),
+               to_ms (percentile (latencies, n, 99)));
+   }
+
+   free (latencies);
+   return true;
+}
+
+bool askme_telemetry_close (askme_telemetry_t *tm)
+{
+   bool ret = true;
+
+   if (!tm)
+      return true;
+
+   askme_telemetry_phase (tm, NULL);
+
+   for (size_t i=0; i<tm->nphases; i++) {
+      fputs ("{\"type\":\"phase\",\"name\":", tm->outf);
+      write_json_string (tm->outf, tm->phases[i].name);
+      fprintf (tm->outf, ",\"start_ms\":%.3f,\"duration_ms\":%.3f}\n",
+               to_ms (tm->phases[i].start_ns - tm->epoch_ns),
+               to_ms (tm->phases[i].end_ns - tm->phases[i].start_ns));
+   }
+
+   for (size_t i=0; i<tm->nquestions; i++) {
+      struct question_t *rec = &tm->questions[i];
+      fputs ("{\"type\":\"question\",\"topic\":", tm->outf);
+      write_json_string (tm->outf, tm->topics[rec->topic]);
+      fprintf (tm->outf, ",\"position\":%zu,\"question\":%zu"
+                         ",\"latency_ms\":%.3f,\"retries\":%zu,\"correct\":%s}\n",
+               rec->position + 1, rec->question,
+               to_ms (rec->latency_ns), rec->retries,
+               rec->correct < 0 ? "null" : rec->correct ? "true" : "false");
+   }
+
+   ret = write_summary (tm);
+
+   if ((fclose (tm->outf))!=0) {
+      ASKME_LOG ("Failed to write [%s]: %m\n", tm->fname);
+      ret = false;
+   }
+
+   for (size_t i=0; i<tm->ntopics; i++) {
+      free (tm->topics[i]);
+   }
+   free (tm->topics);
+   free (tm->questions);
+   free (tm->fname);
+   free (tm);
+
+   return ret;
+}